@@ -262,6 +262,16 @@ int App::run()
                     }
                     if(currentEvent.key.keysym.scancode == SDL_SCANCODE_LSHIFT)
                         editor->isShiftPressed = true;
+                    if(currentEvent.key.keysym.scancode == SDL_SCANCODE_LALT)
+                        mIsAltPressed = true;
+                    if(currentEvent.key.keysym.scancode == SDL_SCANCODE_Q)
+                        mIsLassoPressed = true;
+                    if(currentEvent.key.keysym.scancode == SDL_SCANCODE_1)
+                        editor->selectionKind = SelectionKind::Vertices;
+                    if(currentEvent.key.keysym.scancode == SDL_SCANCODE_2)
+                        editor->selectionKind = SelectionKind::Edges;
+                    if(currentEvent.key.keysym.scancode == SDL_SCANCODE_3)
+                        editor->selectionKind = SelectionKind::Faces;
                     if(currentEvent.key.keysym.scancode == SDL_SCANCODE_S) {
                         for(auto eh : model.originalMesh.edges()) {
                             if(eh.selected())
@@ -417,6 +427,10 @@ int App::run()
                 else if(mDemoType == DemoType::HALF_EDGE_3D) {
                     if(currentEvent.key.keysym.scancode == SDL_SCANCODE_LSHIFT)
                         editor->isShiftPressed = false;
+                    if(currentEvent.key.keysym.scancode == SDL_SCANCODE_LALT)
+                        mIsAltPressed = false;
+                    if(currentEvent.key.keysym.scancode == SDL_SCANCODE_Q)
+                        mIsLassoPressed = false;
                 }
                 break;
 			case SDL_WINDOWEVENT:
@@ -444,6 +458,10 @@ int App::run()
 //                        rayY = y;
                         isMouseDown = true;
                         isMouseMoved = false;
+                        if(mDemoType == DemoType::HALF_EDGE_3D && (mIsAltPressed || mIsLassoPressed)) {
+                            mSelectionPath.clear();
+                            mSelectionPath.push_back(glm::vec2(currentEvent.button.x, currentEvent.button.y));
+                        }
                     }
 				}
 				break;
@@ -451,18 +469,26 @@ int App::run()
                 if(currentEvent.button.button == SDL_BUTTON_LEFT) {
                     isMouseDown = false;
                     if(mDemoType == DemoType::HALF_EDGE_3D) {
+                        glm::vec2 mouse = glm::vec2(mMouseX, mMouseY);
+                        glm::vec2 screenDims = glm::vec2(mWidth, mHeight);
                         if(!isMouseMoved) { // On click
-                            glm::vec2 mouse = glm::vec2(mMouseX, mMouseY);
-                            glm::vec2 screenDims = glm::vec2(mWidth, mHeight);
                             editor->raycastEdges(mouse, screenDims, mImmediateContext);
+                        } else if(mSelectionPath.size() > 2) {
+                            editor->selectInLasso(mSelectionPath, screenDims, mImmediateContext);
+                        } else if(mSelectionPath.size() == 1) {
+                            editor->selectInRectangle(mSelectionPath[0], mouse, screenDims, mImmediateContext);
                         }
+                        mSelectionPath.clear();
                     }
                 }
             case SDL_MOUSEMOTION:
                 isMouseMoved = true;
                 mMouseX = currentEvent.motion.x;
                 mMouseY = currentEvent.motion.y;
-                if(isMouseDown) {
+                if(isMouseDown && !mSelectionPath.empty()) {
+                    if(mIsLassoPressed)
+                        mSelectionPath.push_back(glm::vec2(mMouseX, mMouseY));
+                } else if(isMouseDown) {
                     if(mIsControlPressed) {
                         mZoom += currentEvent.motion.yrel * 0.05f;
                     } else {
@@ -474,6 +500,8 @@ int App::run()
                             mPitch += glm::radians((float)currentEvent.motion.yrel) * 25.0f;
                         }
                     }
+                } else if(mDemoType == DemoType::HALF_EDGE_3D) {
+                    editor->hoverAt(glm::vec2(mMouseX, mMouseY), glm::vec2(mWidth, mHeight));
                 }
                 break;
 			default:
@@ -701,6 +729,7 @@ void App::draw()
         break;
     case DemoType::HALF_EDGE_3D:
     {
+        editor->pollBooleanJob(mImmediateContext);
         editor->eye = eye;
         editor->measureDistance();
         editor->recreateWireframeIfNeed(mImmediateContext);
@@ -713,8 +742,8 @@ void App::draw()
 //            converter.from_bytes(std::to_string(roundedDistance).c_str());
 //        bvgCtx.print(distanceStr, 10, 40);
         
-        editor->viewProj = vp;
-        editor->view = view;
+        editor->setCamera(vp, view);
+        editor->updateHover(mImmediateContext);
         editor->draw(mImmediateContext);
     }
         break;
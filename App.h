@@ -121,6 +121,11 @@ private:
         mMouseY = 0.0f;
     
     bool mIsControlPressed = false;
+    // Dragging with left alt selects in a rectangle, with Q held in a lasso
+    bool mIsAltPressed = false;
+    bool mIsLassoPressed = false;
+    // Start of the rectangle or the points of the lasso while dragging
+    std::vector<glm::vec2> mSelectionPath;
     
     glm::mat4 mModel = glm::mat4(1.0f);
     gizmo::Transform mTransform;
@@ -0,0 +1,61 @@
+//
+//  Arena.cpp
+//  MyProject
+//
+//
+
+#include "Arena.h"
+
+Arena::Arena(size_t blockSize):
+    blockSize(blockSize) {}
+
+Arena::~Arena() {
+    release();
+}
+
+void* Arena::allocate(size_t size, size_t alignment) {
+    if(!blocks.empty()) {
+        Block& block = blocks.back();
+        size_t offset = (block.used + alignment - 1) & ~(alignment - 1);
+        if(offset + size <= block.size) {
+            block.used = offset + size;
+            return block.data + offset;
+        }
+    }
+    Block block;
+    if(size > blockSize / 4) {
+        // Large allocations get a block of their own and
+        // leave the current block open for small ones
+        block.data = static_cast<char*>(::operator new(size));
+        block.size = size;
+        block.used = size;
+        blocks.insert(blocks.empty() ? blocks.end() : blocks.end() - 1, block);
+        return block.data;
+    }
+    block.data = static_cast<char*>(::operator new(blockSize));
+    block.size = blockSize;
+    block.used = size;
+    blocks.push_back(block);
+    return block.data;
+}
+
+void Arena::adopt(Arena& other) {
+    if(&other == this)
+        return;
+    // Adopted blocks go before the current one so it stays open
+    blocks.insert(blocks.empty() ? blocks.end() : blocks.end() - 1,
+                  other.blocks.begin(), other.blocks.end());
+    destructors.insert(destructors.end(),
+                       other.destructors.begin(), other.destructors.end());
+    other.blocks.clear();
+    other.destructors.clear();
+}
+
+void Arena::release() {
+    for(auto it = destructors.rbegin(); it != destructors.rend(); it++)
+        it->destroy(it->object);
+    destructors.clear();
+    for(Block& block : blocks)
+        ::operator delete(block.data);
+    blocks.clear();
+}
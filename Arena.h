@@ -0,0 +1,71 @@
+//
+//  Arena.h
+//  MyProject
+//
+//
+
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Bump allocator that owns every object created through it
+// and frees them all at once when it is released or destroyed
+class Arena {
+    struct Block {
+        char* data;
+        size_t size;
+        size_t used;
+    };
+
+    struct Destructor {
+        void (*destroy)(void* object);
+        void* object;
+    };
+
+    template<typename T>
+    static void destroy(void* object) {
+        static_cast<T*>(object)->~T();
+    }
+
+    std::vector<Block> blocks;
+    std::vector<Destructor> destructors;
+    size_t blockSize;
+
+public:
+    explicit Arena(size_t blockSize = 64 * 1024);
+    ~Arena();
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    void* allocate(size_t size, size_t alignment);
+
+    template<typename T, typename... Args>
+    T* make(Args&&... args) {
+        T* object = new (allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+        // Only non-trivial objects cost anything on release
+        if(!std::is_trivially_destructible<T>::value)
+            destructors.push_back({ &Arena::destroy<T>, object });
+        return object;
+    }
+
+    // Uninitialized storage for plain data such as pointer spans
+    template<typename T>
+    T* makeArray(size_t count) {
+        static_assert(std::is_trivially_destructible<T>::value,
+                      "Arena arrays are never destructed");
+        return static_cast<T*>(allocate(sizeof(T) * count, alignof(T)));
+    }
+
+    // Takes over everything allocated by other, which is left empty.
+    // Lets worker threads fill arenas of their own and hand the
+    // results back once they are joined
+    void adopt(Arena& other);
+
+    // Runs pending destructors and frees every block
+    void release();
+};
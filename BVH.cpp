@@ -0,0 +1,367 @@
+//
+//  BVH.cpp
+//  MyProject
+//
+//
+
+#include "BVH.h"
+#include <algorithm>
+#include <cassert>
+#include <limits>
+
+AABB::AABB():
+    min(std::numeric_limits<float>::max()), max(-std::numeric_limits<float>::max()) {}
+
+AABB::AABB(glm::vec3 min, glm::vec3 max):
+    min(min), max(max) {}
+
+void AABB::expand(glm::vec3 point) {
+    min = glm::min(min, point);
+    max = glm::max(max, point);
+}
+
+void AABB::expand(const AABB& box) {
+    min = glm::min(min, box.min);
+    max = glm::max(max, box.max);
+}
+
+void AABB::pad(float amount) {
+    min -= glm::vec3(amount);
+    max += glm::vec3(amount);
+}
+
+bool AABB::overlaps(const AABB& other) const {
+    return min.x <= other.max.x && max.x >= other.min.x &&
+        min.y <= other.max.y && max.y >= other.min.y &&
+        min.z <= other.max.z && max.z >= other.min.z;
+}
+
+bool AABB::intersectsRay(glm::vec3 origin, glm::vec3 invDirection, float maxDistance,
+                         float& entry) const {
+    glm::vec3 t0 = (min - origin) * invDirection;
+    glm::vec3 t1 = (max - origin) * invDirection;
+    glm::vec3 tNear = glm::min(t0, t1);
+    glm::vec3 tFar = glm::max(t0, t1);
+    entry = std::max(std::max(tNear.x, tNear.y), std::max(tNear.z, 0.0f));
+    float exit = std::min(std::min(tFar.x, tFar.y), std::min(tFar.z, maxDistance));
+    return entry <= exit;
+}
+
+float AABB::distanceSquared(glm::vec3 point) const {
+    glm::vec3 outside = glm::max(glm::max(min - point, point - max), glm::vec3(0.0f));
+    return glm::dot(outside, outside);
+}
+
+glm::vec3 AABB::center() const {
+    return (min + max) * 0.5f;
+}
+
+bool Frustum::contains(glm::vec3 point) const {
+    for(auto& plane : planes) {
+        if(glm::dot(glm::vec3(plane), point) + plane.w < 0.0f)
+            return false;
+    }
+    return true;
+}
+
+Overlap Frustum::classify(const AABB& box) const {
+    // Empty boxes would give infinities of both signs below
+    if(box.min.x > box.max.x)
+        return Overlap::None;
+    Overlap overlap = Overlap::Full;
+    for(auto& plane : planes) {
+        glm::vec3 normal = glm::vec3(plane);
+        // Corners of the box furthest along the normal and against it
+        glm::vec3 furthest(normal.x >= 0.0f ? box.max.x : box.min.x,
+                           normal.y >= 0.0f ? box.max.y : box.min.y,
+                           normal.z >= 0.0f ? box.max.z : box.min.z);
+        glm::vec3 nearest(normal.x >= 0.0f ? box.min.x : box.max.x,
+                          normal.y >= 0.0f ? box.min.y : box.max.y,
+                          normal.z >= 0.0f ? box.min.z : box.max.z);
+        if(glm::dot(normal, furthest) + plane.w < 0.0f)
+            return Overlap::None;
+        if(glm::dot(normal, nearest) + plane.w < 0.0f)
+            overlap = Overlap::Partial;
+    }
+    return overlap;
+}
+
+void BVH::build(const std::vector<AABB>& boxes) {
+    this->boxes = boxes;
+    nodes.clear();
+    indices.resize(boxes.size());
+    for(int i = 0; i < boxes.size(); i++)
+        indices[i] = i;
+    if(boxes.empty())
+        return;
+    nodes.reserve(boxes.size() * 2 / MaxLeafSize + 1);
+    nodes.push_back({ AABB(), 0, (int)boxes.size() });
+    std::vector<int> stack;
+    stack.push_back(0);
+    while(!stack.empty()) {
+        int nodeIndex = stack.back();
+        stack.pop_back();
+        int first = nodes[nodeIndex].first;
+        int count = nodes[nodeIndex].count;
+        AABB box;
+        AABB centers;
+        for(int i = first; i < first + count; i++) {
+            box.expand(boxes[indices[i]]);
+            centers.expand(boxes[indices[i]].center());
+        }
+        nodes[nodeIndex].box = box;
+        if(count <= MaxLeafSize)
+            continue;
+        // Median split along the longest axis of the centers
+        glm::vec3 extent = centers.max - centers.min;
+        int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+        int half = count / 2;
+        std::nth_element(indices.begin() + first, indices.begin() + first + half,
+                         indices.begin() + first + count,
+                         [&boxes, axis](int a, int b) {
+                             return boxes[a].center()[axis] < boxes[b].center()[axis];
+                         });
+        int left = nodes.size();
+        nodes.push_back({ AABB(), first, half });
+        nodes.push_back({ AABB(), first + half, count - half });
+        nodes[nodeIndex].first = left;
+        nodes[nodeIndex].count = 0;
+        stack.push_back(left + 1);
+        stack.push_back(left);
+    }
+}
+
+void BVH::refit(const std::vector<AABB>& boxes) {
+    assert(boxes.size() == this->boxes.size());
+    this->boxes = boxes;
+    // Children always come after their parent
+    for(int i = (int)nodes.size() - 1; i >= 0; i--) {
+        Node& node = nodes[i];
+        AABB box;
+        if(node.count == 0) {
+            box.expand(nodes[node.first].box);
+            box.expand(nodes[node.first + 1].box);
+        } else {
+            for(int j = node.first; j < node.first + node.count; j++)
+                box.expand(boxes[indices[j]]);
+        }
+        node.box = box;
+    }
+}
+
+void BVH::query(const AABB& box, std::vector<int>& out) const {
+    if(nodes.empty())
+        return;
+    std::vector<int> stack;
+    stack.push_back(0);
+    while(!stack.empty()) {
+        const Node& node = nodes[stack.back()];
+        stack.pop_back();
+        if(!node.box.overlaps(box))
+            continue;
+        if(node.count == 0) {
+            stack.push_back(node.first + 1);
+            stack.push_back(node.first);
+            continue;
+        }
+        for(int i = node.first; i < node.first + node.count; i++) {
+            if(boxes[indices[i]].overlaps(box))
+                out.push_back(indices[i]);
+        }
+    }
+}
+
+void BVH::query(const std::function<Overlap(const AABB&)>& classify,
+                std::vector<int>& full, std::vector<int>& partial) const {
+    if(nodes.empty())
+        return;
+    std::vector<int> stack;
+    stack.push_back(0);
+    while(!stack.empty()) {
+        const Node& node = nodes[stack.back()];
+        stack.pop_back();
+        Overlap overlap = classify(node.box);
+        if(overlap == Overlap::None)
+            continue;
+        if(overlap == Overlap::Full) {
+            // A subtree owns one range of indices, from the first entry
+            // of its leftmost leaf to the last of its rightmost one
+            const Node* left = &node;
+            while(left->count == 0)
+                left = &nodes[left->first];
+            const Node* right = &node;
+            while(right->count == 0)
+                right = &nodes[right->first + 1];
+            full.insert(full.end(), indices.begin() + left->first,
+                        indices.begin() + right->first + right->count);
+            continue;
+        }
+        if(node.count == 0) {
+            stack.push_back(node.first + 1);
+            stack.push_back(node.first);
+            continue;
+        }
+        for(int i = node.first; i < node.first + node.count; i++) {
+            overlap = classify(boxes[indices[i]]);
+            if(overlap == Overlap::Full)
+                full.push_back(indices[i]);
+            else if(overlap == Overlap::Partial)
+                partial.push_back(indices[i]);
+        }
+    }
+}
+
+void BVH::queryOverlaps(const BVH& other, std::vector<std::pair<int, int>>& out) const {
+    if(nodes.empty() || other.nodes.empty())
+        return;
+    std::vector<std::pair<int, int>> stack;
+    stack.push_back({ 0, 0 });
+    while(!stack.empty()) {
+        const Node& a = nodes[stack.back().first];
+        const Node& b = other.nodes[stack.back().second];
+        stack.pop_back();
+        if(!a.box.overlaps(b.box))
+            continue;
+        bool isLeafA = a.count != 0;
+        bool isLeafB = b.count != 0;
+        if(isLeafA && isLeafB) {
+            for(int i = a.first; i < a.first + a.count; i++) {
+                for(int j = b.first; j < b.first + b.count; j++) {
+                    if(boxes[indices[i]].overlaps(other.boxes[other.indices[j]]))
+                        out.push_back({ indices[i], other.indices[j] });
+                }
+            }
+            continue;
+        }
+        // Descend into the inner node with the bigger box,
+        // so both sides shrink at about the same rate
+        glm::vec3 extentA = a.box.max - a.box.min;
+        glm::vec3 extentB = b.box.max - b.box.min;
+        bool descendA = isLeafB || (!isLeafA &&
+            extentA.x + extentA.y + extentA.z >= extentB.x + extentB.y + extentB.z);
+        int nodeA = &a - nodes.data();
+        int nodeB = &b - other.nodes.data();
+        if(descendA) {
+            stack.push_back({ a.first + 1, nodeB });
+            stack.push_back({ a.first, nodeB });
+        } else {
+            stack.push_back({ nodeA, b.first + 1 });
+            stack.push_back({ nodeA, b.first });
+        }
+    }
+}
+
+template<typename Leaf>
+float BVH::traverse(glm::vec3 origin, glm::vec3 direction, float maxDistance, Leaf leaf) const {
+    float nearest = maxDistance;
+    glm::vec3 invDirection = 1.0f / direction;
+    float entry = 0.0f;
+    if(nodes.empty() || !nodes[0].box.intersectsRay(origin, invDirection, nearest, entry))
+        return nearest;
+    // Node and the distance where the ray gets into it
+    std::vector<std::pair<int, float>> stack;
+    stack.push_back({ 0, entry });
+    while(!stack.empty()) {
+        int nodeIndex = stack.back().first;
+        float nodeEntry = stack.back().second;
+        stack.pop_back();
+        if(nodeEntry > nearest)
+            continue;
+        const Node& node = nodes[nodeIndex];
+        if(node.count != 0) {
+            nearest = leaf(node, invDirection, nearest);
+            continue;
+        }
+        float entryA = 0.0f;
+        float entryB = 0.0f;
+        bool isHitA = nodes[node.first].box.intersectsRay(origin, invDirection, nearest, entryA);
+        bool isHitB = nodes[node.first + 1].box.intersectsRay(origin, invDirection, nearest, entryB);
+        // The nearer child goes on top
+        if(isHitA && isHitB && entryA < entryB) {
+            stack.push_back({ node.first + 1, entryB });
+            stack.push_back({ node.first, entryA });
+        } else {
+            if(isHitA)
+                stack.push_back({ node.first, entryA });
+            if(isHitB)
+                stack.push_back({ node.first + 1, entryB });
+        }
+    }
+    return nearest;
+}
+
+float BVH::raycast(glm::vec3 origin, glm::vec3 direction, float maxDistance,
+                   const std::function<float(int)>& hit) const {
+    return traverse(origin, direction, maxDistance,
+                    [this, origin, &hit](const Node& node, glm::vec3 invDirection, float nearest) {
+        for(int i = node.first; i < node.first + node.count; i++) {
+            float entry = 0.0f;
+            if(!boxes[indices[i]].intersectsRay(origin, invDirection, nearest, entry))
+                continue;
+            float distance = hit(indices[i]);
+            if(distance >= 0.0f && distance < nearest)
+                nearest = distance;
+        }
+        return nearest;
+    });
+}
+
+float BVH::raycastLeaves(glm::vec3 origin, glm::vec3 direction, float maxDistance,
+                         const std::function<float(int first, int count)>& hit) const {
+    return traverse(origin, direction, maxDistance,
+                    [&hit](const Node& node, glm::vec3 invDirection, float nearest) {
+        float distance = hit(node.first, node.count);
+        return distance >= 0.0f && distance < nearest ? distance : nearest;
+    });
+}
+
+float BVH::nearest(glm::vec3 point, float maxDistanceSquared, int* index) const {
+    float nearest = maxDistanceSquared;
+    if(nodes.empty())
+        return nearest;
+    // Node and the squared distance to its box
+    std::vector<std::pair<int, float>> stack;
+    stack.push_back({ 0, nodes[0].box.distanceSquared(point) });
+    while(!stack.empty()) {
+        int nodeIndex = stack.back().first;
+        float nodeDistance = stack.back().second;
+        stack.pop_back();
+        if(nodeDistance >= nearest)
+            continue;
+        const Node& node = nodes[nodeIndex];
+        if(node.count != 0) {
+            for(int i = node.first; i < node.first + node.count; i++) {
+                float distance = boxes[indices[i]].distanceSquared(point);
+                if(distance < nearest) {
+                    nearest = distance;
+                    if(index != nullptr)
+                        *index = indices[i];
+                }
+            }
+            continue;
+        }
+        float distanceA = nodes[node.first].box.distanceSquared(point);
+        float distanceB = nodes[node.first + 1].box.distanceSquared(point);
+        // The nearer child goes on top
+        if(distanceA < distanceB) {
+            stack.push_back({ node.first + 1, distanceB });
+            stack.push_back({ node.first, distanceA });
+        } else {
+            stack.push_back({ node.first, distanceA });
+            stack.push_back({ node.first + 1, distanceB });
+        }
+    }
+    return nearest;
+}
+
+bool BVH::isEmpty() const {
+    return nodes.empty();
+}
+
+int BVH::size() const {
+    return boxes.size();
+}
+
+const std::vector<int>& BVH::getOrder() const {
+    return indices;
+}
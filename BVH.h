@@ -0,0 +1,114 @@
+//
+//  BVH.h
+//  MyProject
+//
+//
+
+#pragma once
+
+#include <glm/glm.hpp>
+#include <functional>
+#include <utility>
+#include <vector>
+
+struct AABB {
+    glm::vec3 min, max;
+
+    // Empty box, expanding it by anything gives that thing's box
+    AABB();
+    AABB(glm::vec3 min, glm::vec3 max);
+
+    void expand(glm::vec3 point);
+    void expand(const AABB& box);
+    void pad(float amount);
+    bool overlaps(const AABB& other) const;
+    // Slab test, entry is where the ray gets into the box
+    // or zero when it starts inside
+    bool intersectsRay(glm::vec3 origin, glm::vec3 invDirection, float maxDistance,
+                       float& entry) const;
+    // Squared distance from point to the nearest point of the box,
+    // zero inside and infinity for an empty box
+    float distanceSquared(glm::vec3 point) const;
+    glm::vec3 center() const;
+};
+
+// How much of a box a query region covers
+enum class Overlap {
+    None,
+    Partial,
+    Full
+};
+
+// Convex volume, points p with dot(plane, vec4(p, 1)) >= 0
+// for every plane are inside. Planes need not be normalized
+struct Frustum {
+    std::vector<glm::vec4> planes;
+
+    bool contains(glm::vec3 point) const;
+    Overlap classify(const AABB& box) const;
+};
+
+// Bounding volume hierarchy over a fixed set of boxes. Nodes live in one
+// array with the two children of a node next to each other, and every
+// traversal runs on an explicit stack
+class BVH {
+public:
+    // Replaces the contents, indices returned by queries refer to boxes
+    void build(const std::vector<AABB>& boxes);
+    // Takes new boxes for the same entries and updates the node boxes
+    // without building again. Cheap, but the tree gets looser the more
+    // the boxes moved since it was built
+    void refit(const std::vector<AABB>& boxes);
+    // Appends indices of the boxes overlapping box
+    void query(const AABB& box, std::vector<int>& out) const;
+    // Appends indices of the boxes classify says are covered in full to full
+    // and of the partly covered ones to partial. A node covered in full is
+    // taken whole without looking at its children or boxes, so empty
+    // boxes in such a node come along
+    void query(const std::function<Overlap(const AABB&)>& classify,
+               std::vector<int>& full, std::vector<int>& partial) const;
+    // Appends every pair of overlapping boxes, first from this
+    // hierarchy and second from other
+    void queryOverlaps(const BVH& other, std::vector<std::pair<int, int>>& out) const;
+    // Calls hit for every box the ray passes through, nearer nodes first.
+    // hit returns the distance to what it found for that index or a negative
+    // value, boxes behind the nearest hit are skipped. Returns the distance
+    // to the nearest hit, maxDistance if there was none
+    float raycast(glm::vec3 origin, glm::vec3 direction, float maxDistance,
+                  const std::function<float(int)>& hit) const;
+    // Same, but hit gets the entries of a whole leaf, as a range of
+    // getOrder(). Lets the caller keep its data in that order and test
+    // a leaf in one go
+    float raycastLeaves(glm::vec3 origin, glm::vec3 direction, float maxDistance,
+                        const std::function<float(int first, int count)>& hit) const;
+    // Squared distance from point to the nearest box, visiting nearer nodes
+    // first and skipping the ones further than the nearest box so far.
+    // Returns maxDistanceSquared and leaves index alone if no box is closer
+    float nearest(glm::vec3 point, float maxDistanceSquared, int* index = nullptr) const;
+
+    bool isEmpty() const;
+    // Number of boxes
+    int size() const;
+    // Box indices in leaf order
+    const std::vector<int>& getOrder() const;
+
+private:
+    struct Node {
+        AABB box;
+        // First child for inner nodes, first entry of indices for leaves
+        int first;
+        // Zero for inner nodes
+        int count;
+    };
+
+    static constexpr int MaxLeafSize = 4;
+
+    // Visits leaves the ray gets into, nearer first. leaf takes the node, the
+    // inverse of direction and the nearest distance so far, returns the new one
+    template<typename Leaf>
+    float traverse(glm::vec3 origin, glm::vec3 direction, float maxDistance, Leaf leaf) const;
+
+    std::vector<Node> nodes;
+    std::vector<int> indices;
+    std::vector<AABB> boxes;
+};
@@ -0,0 +1,406 @@
+//
+//  BooleanBenchmark.cpp
+//  MyProject
+//
+//
+
+// Times mesh booleans on generated operands, one stage at a time.
+// Usage: BooleanBenchmark [name filter]
+
+#include "Mesh.h"
+#include <glm/gtc/constants.hpp>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <new>
+#include <string>
+#include <tuple>
+
+// Every allocation of the process goes through the operators below,
+// so the counters see OpenMesh and the standard containers as well
+// as the arenas of the operation
+
+static std::atomic<size_t> numAllocations(0);
+static std::atomic<size_t> currentBytes(0);
+static std::atomic<size_t> peakBytes(0);
+
+// Size of each block is kept in front of it, padded to keep alignment
+static constexpr size_t AllocationHeader = 16;
+
+static void* countedAlloc(size_t size) {
+    void* block = std::malloc(size + AllocationHeader);
+    if(block == nullptr)
+        return nullptr;
+    *static_cast<size_t*>(block) = size;
+    numAllocations++;
+    size_t current = currentBytes += size;
+    size_t peak = peakBytes.load();
+    while(current > peak && !peakBytes.compare_exchange_weak(peak, current)) {}
+    return static_cast<char*>(block) + AllocationHeader;
+}
+
+static void countedFree(void* ptr) {
+    if(ptr == nullptr)
+        return;
+    void* block = static_cast<char*>(ptr) - AllocationHeader;
+    currentBytes -= *static_cast<size_t*>(block);
+    std::free(block);
+}
+
+void* operator new(size_t size) {
+    void* ptr = countedAlloc(size);
+    if(ptr == nullptr)
+        throw std::bad_alloc();
+    return ptr;
+}
+
+void* operator new[](size_t size) {
+    void* ptr = countedAlloc(size);
+    if(ptr == nullptr)
+        throw std::bad_alloc();
+    return ptr;
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    return countedAlloc(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+    return countedAlloc(size);
+}
+
+void operator delete(void* ptr) noexcept {
+    countedFree(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+    countedFree(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+    countedFree(ptr);
+}
+
+void operator delete[](void* ptr, size_t) noexcept {
+    countedFree(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept {
+    countedFree(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept {
+    countedFree(ptr);
+}
+
+static PolyMesh makeEmptyMesh() {
+    PolyMesh mesh;
+    mesh.request_vertex_normals();
+    mesh.request_face_normals();
+    mesh.request_vertex_status();
+    mesh.request_face_status();
+    mesh.request_edge_status();
+    mesh.request_halfedge_status();
+    return mesh;
+}
+
+// Box with every side cut into divisions x divisions quads
+static PolyMesh makeBox(glm::vec3 min, glm::vec3 max, int divisions) {
+    PolyMesh mesh = makeEmptyMesh();
+    std::map<std::tuple<int, int, int>, PolyMesh::VertexHandle> lattice;
+    auto vertex = [&](int i, int j, int k) {
+        auto key = std::make_tuple(i, j, k);
+        auto it = lattice.find(key);
+        if(it != lattice.end())
+            return it->second;
+        glm::vec3 t = glm::vec3(i, j, k) / (float)divisions;
+        PolyMesh::VertexHandle vh = mesh.add_vertex(vec3ToPoint(glm::mix(min, max, t)));
+        lattice[key] = vh;
+        return vh;
+    };
+    for(int axis = 0; axis < 3; axis++) {
+        for(int side = 0; side < 2; side++) {
+            for(int u = 0; u < divisions; u++) {
+                for(int v = 0; v < divisions; v++) {
+                    int corners[4][2] = { { u, v }, { u + 1, v }, { u + 1, v + 1 }, { u, v + 1 } };
+                    std::vector<PolyMesh::VertexHandle> face;
+                    for(auto& corner : corners) {
+                        int coords[3];
+                        coords[axis] = side * divisions;
+                        coords[(axis + 1) % 3] = corner[0];
+                        coords[(axis + 2) % 3] = corner[1];
+                        face.push_back(vertex(coords[0], coords[1], coords[2]));
+                    }
+                    // Corners go counter-clockwise around +axis
+                    if(side == 0)
+                        std::reverse(face.begin(), face.end());
+                    mesh.add_face(face);
+                }
+            }
+        }
+    }
+    mesh.update_normals();
+    return mesh;
+}
+
+static PolyMesh makeSphere(glm::vec3 center, float radius, int segments, int rings) {
+    PolyMesh mesh = makeEmptyMesh();
+    auto point = [&](float theta, float phi) {
+        return vec3ToPoint(center + radius * glm::vec3(std::sin(theta) * std::cos(phi),
+                                                       std::cos(theta),
+                                                       std::sin(theta) * std::sin(phi)));
+    };
+    PolyMesh::VertexHandle north = mesh.add_vertex(point(0.0f, 0.0f));
+    std::vector<std::vector<PolyMesh::VertexHandle>> ringVerts(rings - 1);
+    for(int r = 0; r < rings - 1; r++) {
+        float theta = glm::pi<float>() * (r + 1) / rings;
+        for(int s = 0; s < segments; s++)
+            ringVerts[r].push_back(mesh.add_vertex(point(theta, glm::two_pi<float>() * s / segments)));
+    }
+    PolyMesh::VertexHandle south = mesh.add_vertex(point(glm::pi<float>(), 0.0f));
+    for(int s = 0; s < segments; s++) {
+        int next = (s + 1) % segments;
+        mesh.add_face(north, ringVerts.front()[next], ringVerts.front()[s]);
+        for(int r = 0; r + 1 < rings - 1; r++) {
+            mesh.add_face(std::vector<PolyMesh::VertexHandle> {
+                ringVerts[r][s], ringVerts[r][next], ringVerts[r + 1][next], ringVerts[r + 1][s]
+            });
+        }
+        mesh.add_face(ringVerts.back()[s], ringVerts.back()[next], south);
+    }
+    mesh.update_normals();
+    return mesh;
+}
+
+// Appends a closed cylinder standing on base along +y
+static void addCylinder(PolyMesh& mesh, glm::vec3 base, float radius, float height, int segments) {
+    std::vector<PolyMesh::VertexHandle> bottom, top;
+    for(int s = 0; s < segments; s++) {
+        float phi = glm::two_pi<float>() * s / segments;
+        glm::vec3 offset(radius * std::cos(phi), 0.0f, radius * std::sin(phi));
+        bottom.push_back(mesh.add_vertex(vec3ToPoint(base + offset)));
+        top.push_back(mesh.add_vertex(vec3ToPoint(base + offset + glm::vec3(0.0f, height, 0.0f))));
+    }
+    for(int s = 0; s < segments; s++) {
+        int next = (s + 1) % segments;
+        mesh.add_face(std::vector<PolyMesh::VertexHandle> {
+            bottom[s], top[s], top[next], bottom[next]
+        });
+    }
+    mesh.add_face(std::vector<PolyMesh::VertexHandle>(top.rbegin(), top.rend()));
+    mesh.add_face(bottom);
+}
+
+static std::vector<PolyMesh> makeCylinderGrid(int count, float spacing, float radius,
+                                              float bottom, float height, int segments) {
+    std::vector<PolyMesh> cylinders;
+    for(int i = 0; i < count; i++) {
+        for(int j = 0; j < count; j++) {
+            PolyMesh cylinder = makeEmptyMesh();
+            glm::vec3 base((i + 0.5f) * spacing, bottom, (j + 0.5f) * spacing);
+            addCylinder(cylinder, base, radius, height, segments);
+            cylinder.update_normals();
+            cylinders.push_back(cylinder);
+        }
+    }
+    return cylinders;
+}
+
+static PolyMesh mergeMeshes(std::vector<PolyMesh>& meshes) {
+    PolyMesh merged = makeEmptyMesh();
+    for(auto& mesh : meshes) {
+        std::vector<PolyMesh::VertexHandle> vertexMap;
+        for(auto vh : mesh.vertices())
+            vertexMap.push_back(merged.add_vertex(mesh.point(vh)));
+        for(auto fh : mesh.faces()) {
+            std::vector<PolyMesh::VertexHandle> face;
+            for(auto fvh : fh.vertices_ccw())
+                face.push_back(vertexMap[fvh.idx()]);
+            merged.add_face(face);
+        }
+    }
+    merged.update_normals();
+    return merged;
+}
+
+class Stopwatch {
+    std::chrono::steady_clock::time_point last = std::chrono::steady_clock::now();
+
+public:
+    // Milliseconds since the previous lap
+    double lap() {
+        auto now = std::chrono::steady_clock::now();
+        double ms = std::chrono::duration<double, std::milli>(now - last).count();
+        last = now;
+        return ms;
+    }
+};
+
+struct BenchmarkResult {
+    size_t numFacesA = 0;
+    size_t numFacesB = 0;
+    size_t numInsideA = 0;
+    size_t numInsideB = 0;
+    size_t numClipped = 0;
+    size_t numOutputFaces = 0;
+    double extractMs = 0.0;
+    double cullMs = 0.0;
+    double buildMs = 0.0;
+    double clipMs = 0.0;
+    double toMeshMs = 0.0;
+    double postProcessMs = 0.0;
+    double totalMs = 0.0;
+    size_t peakBytes = 0;
+    size_t numAllocations = 0;
+};
+
+static void beginMeasure(size_t& baselineBytes, size_t& baselineAllocations) {
+    baselineBytes = currentBytes.load();
+    baselineAllocations = numAllocations.load();
+    peakBytes = baselineBytes;
+}
+
+static void endMeasure(BenchmarkResult& result, size_t baselineBytes, size_t baselineAllocations) {
+    result.peakBytes = peakBytes.load() - baselineBytes;
+    result.numAllocations = numAllocations.load() - baselineAllocations;
+}
+
+// Same steps as booleanPolygons and booleanMeshes, with a lap after each
+static BenchmarkResult runStages(PolyMesh& a, PolyMesh& b, BooleanOperation operation) {
+    BenchmarkResult result;
+    size_t baselineBytes, baselineAllocations;
+    beginMeasure(baselineBytes, baselineAllocations);
+    {
+        Stopwatch total, stage;
+        CSGContext context;
+        context.pool = &ThreadPool::shared();
+        CSGPolygonList polygonsA = CSGPolygon::extractFromMesh(a, context.arena);
+        CSGPolygonList polygonsB = CSGPolygon::extractFromMesh(b, context.arena);
+        result.extractMs = stage.lap();
+        CSGOverlap overlap = CSGOverlap::fromPolygons(polygonsA, polygonsB, context);
+        result.cullMs = stage.lap();
+        CSGPolygonList polygons;
+        if(operation != BooleanOperation::Intersect)
+            polygons = overlap.outsideA;
+        if(operation == BooleanOperation::Union)
+            polygons.insert(polygons.end(), overlap.outsideB.begin(), overlap.outsideB.end());
+        if(!overlap.insideA.empty() && !overlap.insideB.empty()) {
+            BSPNode* bspA = context.arena.make<BSPNode>(overlap.insideA, context);
+            BSPNode* bspB = context.arena.make<BSPNode>(overlap.insideB, context);
+            result.buildMs = stage.lap();
+            switch(operation) {
+                case BooleanOperation::Union:
+                    unionBSP(bspA, bspB);
+                    break;
+                case BooleanOperation::Subtract:
+                    subtractBSP(bspA, bspB);
+                    break;
+                case BooleanOperation::Intersect:
+                    intersectBSP(bspA, bspB);
+                    break;
+            }
+            size_t numCulled = polygons.size();
+            bspA->collectPolygons(polygons);
+            result.numClipped = polygons.size() - numCulled;
+            result.clipMs = stage.lap();
+        }
+        PolyMesh mesh = CSGPolygon::toMesh(polygons);
+        result.toMeshMs = stage.lap();
+        postProcessBooleanMesh(mesh);
+        result.postProcessMs = stage.lap();
+        result.totalMs = total.lap();
+        result.numFacesA = a.n_faces();
+        result.numFacesB = b.n_faces();
+        result.numInsideA = overlap.insideA.size();
+        result.numInsideB = overlap.insideB.size();
+        result.numOutputFaces = mesh.n_faces();
+    }
+    endMeasure(result, baselineBytes, baselineAllocations);
+    return result;
+}
+
+static void printHeader() {
+    std::printf("%-28s %7s %7s %7s %7s %7s %7s | %8s %8s %8s %8s %8s %8s %9s | %9s %9s\n",
+                "case", "facesA", "facesB", "inA", "inB", "clipped", "out",
+                "extract", "cull", "build", "clip", "toMesh", "post", "total",
+                "peak MB", "allocs");
+}
+
+static void printResult(const std::string& name, const BenchmarkResult& result) {
+    std::printf("%-28s %7zu %7zu %7zu %7zu %7zu %7zu | %8.2f %8.2f %8.2f %8.2f %8.2f %8.2f %9.2f | %9.2f %9zu\n",
+                name.c_str(), result.numFacesA, result.numFacesB,
+                result.numInsideA, result.numInsideB, result.numClipped, result.numOutputFaces,
+                result.extractMs, result.cullMs, result.buildMs, result.clipMs,
+                result.toMeshMs, result.postProcessMs, result.totalMs,
+                result.peakBytes / (1024.0 * 1024.0), result.numAllocations);
+    std::fflush(stdout);
+}
+
+int main(int argc, char* argv[]) {
+    std::string filter = argc > 1 ? argv[1] : "";
+    auto isSelected = [&](const std::string& name) {
+        return filter.empty() || name.find(filter) != std::string::npos;
+    };
+    // Workers of the pool are started outside of any measurement
+    ThreadPool::shared();
+    printHeader();
+
+    for(int divisions : { 4, 16, 32, 64 }) {
+        std::string name = "cube-" + std::to_string(divisions) + " - cube";
+        if(!isSelected(name))
+            continue;
+        PolyMesh a = makeBox(glm::vec3(0.0f), glm::vec3(1.0f), divisions);
+        PolyMesh b = makeBox(glm::vec3(0.5f), glm::vec3(1.5f), divisions);
+        printResult(name, runStages(a, b, BooleanOperation::Subtract));
+    }
+
+    for(int segments : { 16, 32, 64, 128 }) {
+        int rings = segments / 2;
+        for(auto operation : { BooleanOperation::Union, BooleanOperation::Subtract,
+                               BooleanOperation::Intersect }) {
+            const char* operationName = operation == BooleanOperation::Union ? " + " :
+                operation == BooleanOperation::Subtract ? " - " : " & ";
+            std::string name = "sphere-" + std::to_string(segments) + operationName + "sphere";
+            if(!isSelected(name))
+                continue;
+            PolyMesh a = makeSphere(glm::vec3(0.0f), 1.0f, segments, rings);
+            PolyMesh b = makeSphere(glm::vec3(0.6f, 0.3f, 0.2f), 0.8f, segments, rings);
+            printResult(name, runStages(a, b, operation));
+        }
+    }
+
+    // Panel drilled with a grid of holes, as one cutter mesh and as a batch
+    for(int count : { 2, 4, 8, 16 }) {
+        float spacing = 1.0f / count;
+        PolyMesh panel = makeBox(glm::vec3(0.0f), glm::vec3(1.0f, 0.05f, 1.0f), 32);
+        std::vector<PolyMesh> cylinders = makeCylinderGrid(count, spacing, spacing * 0.25f,
+                                                           -0.05f, 0.15f, 24);
+        std::string name = "panel - cylinders-" + std::to_string(count * count);
+        if(isSelected(name)) {
+            PolyMesh cutter = mergeMeshes(cylinders);
+            printResult(name, runStages(panel, cutter, BooleanOperation::Subtract));
+        }
+        name = "panel - batch-" + std::to_string(count * count);
+        if(isSelected(name)) {
+            BenchmarkResult result;
+            size_t baselineBytes, baselineAllocations;
+            beginMeasure(baselineBytes, baselineAllocations);
+            {
+                Stopwatch total;
+                PolyMesh mesh = subtractMeshes(panel, cylinders);
+                result.totalMs = total.lap();
+                result.numFacesA = panel.n_faces();
+                for(auto& cylinder : cylinders)
+                    result.numFacesB += cylinder.n_faces();
+                result.numOutputFaces = mesh.n_faces();
+            }
+            endMeasure(result, baselineBytes, baselineAllocations);
+            printResult(name, result);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,113 @@
+//
+//  BooleanTests.cpp
+//  MyProject
+//
+//
+
+// Regression checks on boolean results. Prints every failed check and
+// exits with 1 if there was any
+
+#include "Mesh.h"
+#include <cstdio>
+
+static int numFailures = 0;
+
+static void check(bool condition, const char* name, const char* what) {
+    if(condition)
+        return;
+    std::printf("FAILED %s: %s\n", name, what);
+    numFailures++;
+}
+
+static PolyMesh makeEmptyMesh() {
+    PolyMesh mesh;
+    mesh.request_vertex_normals();
+    mesh.request_face_normals();
+    mesh.request_vertex_status();
+    mesh.request_face_status();
+    mesh.request_edge_status();
+    mesh.request_halfedge_status();
+    return mesh;
+}
+
+static PolyMesh makeBox(glm::vec3 min, glm::vec3 max) {
+    PolyMesh mesh = makeEmptyMesh();
+    PolyMesh::VertexHandle corners[8];
+    for(int i = 0; i < 8; i++) {
+        corners[i] = mesh.add_vertex(PolyMesh::Point((i & 1) ? max.x : min.x,
+                                                     (i & 2) ? max.y : min.y,
+                                                     (i & 4) ? max.z : min.z));
+    }
+    // Counter-clockwise seen from outside
+    int faces[6][4] = {
+        { 0, 4, 6, 2 }, { 1, 3, 7, 5 },
+        { 0, 1, 5, 4 }, { 2, 6, 7, 3 },
+        { 0, 2, 3, 1 }, { 4, 5, 7, 6 }
+    };
+    for(auto& face : faces) {
+        mesh.add_face(std::vector<PolyMesh::VertexHandle> {
+            corners[face[0]], corners[face[1]], corners[face[2]], corners[face[3]]
+        });
+    }
+    mesh.update_normals();
+    return mesh;
+}
+
+// Closed two-manifold surface of a solid without holes
+static void checkClosedManifold(const PolyMesh& mesh, const char* name) {
+    bool isClosed = true;
+    for(auto heh : mesh.halfedges())
+        isClosed = isClosed && !mesh.is_boundary(heh);
+    check(isClosed, name, "every halfedge has a face");
+    bool isManifold = true;
+    for(auto vh : mesh.vertices())
+        isManifold = isManifold && mesh.is_manifold(vh);
+    check(isManifold, name, "every vertex is manifold");
+    int euler = (int)mesh.n_vertices() - (int)mesh.n_edges() + (int)mesh.n_faces();
+    check(euler == 2, name, "V - E + F is 2");
+}
+
+// Fan triangulation is only right for these
+static void checkConvexFaces(const PolyMesh& mesh, const char* name) {
+    const float threshold = 1e-4f;
+    bool isConvex = true;
+    for(auto fh : mesh.faces()) {
+        glm::vec3 normal = vec3FromPoint(mesh.normal(fh));
+        std::vector<glm::vec3> points;
+        for(auto fvh : mesh.fv_ccw_range(fh))
+            points.push_back(vec3FromPoint(mesh.point(fvh)));
+        for(int i = 0; i < points.size(); i++) {
+            glm::vec3 toCorner = points[i] - points[(i + points.size() - 1) % points.size()];
+            glm::vec3 fromCorner = points[(i + 1) % points.size()] - points[i];
+            float lengths = glm::length(toCorner) * glm::length(fromCorner);
+            if(glm::dot(glm::cross(toCorner, fromCorner), normal) < -threshold * lengths)
+                isConvex = false;
+        }
+    }
+    check(isConvex, name, "every face is convex");
+}
+
+int main() {
+    // Cubes that take a corner off a 2x2x2 cube. The three sides the cut
+    // misses stay single squares, the three it goes through become L shapes
+    // of two convex faces each and the notch has three squares
+    struct CornerCase {
+        const char* name;
+        glm::vec3 cutterMin, cutterMax;
+    };
+    CornerCase cases[] = {
+        { "cube minus corner cube", glm::vec3(0.0f), glm::vec3(2.0f) },
+        { "cube minus offset cube", glm::vec3(-0.5f), glm::vec3(1.5f) }
+    };
+    for(auto& test : cases) {
+        PolyMesh cube = makeBox(glm::vec3(-1.0f), glm::vec3(1.0f));
+        PolyMesh cutter = makeBox(test.cutterMin, test.cutterMax);
+        PolyMesh result = subtractMeshes(cube, cutter);
+        result.update_normals();
+        std::printf("%s: %d faces\n", test.name, (int)result.n_faces());
+        check(result.n_faces() == 12, test.name, "12 faces");
+        checkClosedManifold(result, test.name);
+        checkConvexFaces(result, test.name);
+    }
+    return numFailures == 0 ? 0 : 1;
+}
@@ -8,6 +8,9 @@
 #include "Editor.hpp"
 #include "Graphics/GraphicsTools/interface/CommonlyUsedStates.h"
 #include "Graphics/GraphicsTools/interface/MapHelper.hpp"
+#include <algorithm>
+#include <chrono>
+#include <limits>
 
 void* convertRGBToRGBA(char* imageData,
                        int width,
@@ -92,6 +95,11 @@ Texture::Texture(DgRenderDevice renderDevice,
 Texture::Texture() {}
 
 Ray screenPointToRay(glm::vec2 pos, glm::vec2 screenDims, glm::mat4 viewProj)
+{
+    return screenPointToRayInverse(pos, screenDims, glm::inverse(viewProj));
+}
+
+Ray screenPointToRayInverse(glm::vec2 pos, glm::vec2 screenDims, glm::mat4 invViewProj)
 {
     auto ray = Ray();
 
@@ -99,12 +107,10 @@ Ray screenPointToRay(glm::vec2 pos, glm::vec2 screenDims, glm::mat4 viewProj)
     float normalizedX = pos.x / (screenDims.x * 0.5f) - 1.0f;
     float normalizedY = pos.y / (screenDims.y * 0.5f) - 1.0f;
 
-    glm::mat4 invVP = glm::inverse(viewProj);
-
     glm::vec4 originClipSpace { normalizedX, -normalizedY, -1.0f, 1.0f };
     glm::vec4 destClipSpace { normalizedX, -normalizedY, 1.0f, 1.0f };
-    glm::vec4 originClipSpaceWS = invVP * originClipSpace;
-    glm::vec4 destClipSpaceWS = invVP * destClipSpace;
+    glm::vec4 originClipSpaceWS = invViewProj * originClipSpace;
+    glm::vec4 destClipSpaceWS = invViewProj * destClipSpace;
     glm::vec3 originClipSpaceWS3 = glm::vec3(originClipSpaceWS) / originClipSpaceWS.w;
     glm::vec3 destClipSpaceWS3 = glm::vec3(destClipSpaceWS) / destClipSpaceWS.w;
 
@@ -191,9 +197,16 @@ Model createCubeModel() {
 }
 
 void Model::invalidate(DgRenderDevice renderDevice, DgDeviceContext context, float wireframeThickness) {
+    meshVersion++;
+    // Edge handles may mean other edges now
+    highlightedEdges.clear();
+    updateElementBVHs();
     originalToRenderVerts.clear();
     if(!isFlatShaded) {
         renderMesh = originalMesh;
+        auto originalFaceProp = OpenMesh::getOrMakeProperty<PolyMesh::FaceHandle, int>(renderMesh, "originalFace");
+        for(auto fh : renderMesh.faces())
+            originalFaceProp[fh] = fh.idx();
         auto rvhIt = renderMesh.vertices_begin();
         for(auto ovh : originalMesh.vertices()) {
             originalToRenderVerts[ovh] = *rvhIt;
@@ -208,6 +221,7 @@ void Model::invalidate(DgRenderDevice renderDevice, DgDeviceContext context, flo
         renderMesh.request_vertex_status();
         renderMesh.request_face_status();
         renderMesh.request_edge_status();
+        auto originalFaceProp = OpenMesh::getOrMakeProperty<PolyMesh::FaceHandle, int>(renderMesh, "originalFace");
         for(auto fh : originalMesh.faces()) {
             std::vector<PolyMesh::VertexHandle> faceVerts;
             for(auto vhOriginal : originalMesh.fv_ccw_range(fh)) {
@@ -219,6 +233,7 @@ void Model::invalidate(DgRenderDevice renderDevice, DgDeviceContext context, flo
                 originalToRenderVerts[vhOriginal] = vhRender;
             }
             PolyMesh::FaceHandle newFace = renderMesh.add_face(faceVerts);
+            originalFaceProp[newFace] = fh.idx();
             if(fh.selected())
                 renderMesh.status(newFace).set_selected(true);
         }
@@ -386,9 +401,14 @@ void Model::populateRenderBuffers(DgRenderDevice renderDevice, DgDeviceContext c
         trisSize++;
     }
     
+    // Triangulation copied the property to the new faces
+    auto originalFaceProp = OpenMesh::getOrMakeProperty<PolyMesh::FaceHandle, int>(renderMesh, "originalFace");
+    surfaceFaces.clear();
+    surfaceFaces.reserve(trisSize);
     std::vector<RenderTriange> tris;
     verts.reserve(trisSize);
     for(auto fh : renderMesh.faces()) {
+        surfaceFaces.push_back(originalFaceProp[fh]);
         bool isSelected = fh.selected();
         RenderTriange tri;
         int fvInd = 0;
@@ -415,6 +435,7 @@ void Model::populateRenderBuffers(DgRenderDevice renderDevice, DgDeviceContext c
     
     surfaceVertices = verts;
     surfaceTrianges = tris;
+    updateSurfaceBVH();
         
     if(vertsSize != lastNumVerts || trisSize != lastNumTris) {
         
@@ -460,44 +481,117 @@ void Model::populateRenderBuffers(DgRenderDevice renderDevice, DgDeviceContext c
     recreateWireframe(renderDevice, context, wireframeThickness);
 }
 
+void Model::updateSurfaceBVH() {
+    // The same number of triangles means only positions could have
+    // changed, so the hierarchy is refitted instead of built again
+    std::vector<AABB> boxes(surfaceTrianges.size());
+    for(auto i = 0; i < surfaceTrianges.size(); i++) {
+        RenderTriange tri = surfaceTrianges.at(i);
+        boxes[i].expand(surfaceVertices.at(tri.a).pos);
+        boxes[i].expand(surfaceVertices.at(tri.b).pos);
+        boxes[i].expand(surfaceVertices.at(tri.c).pos);
+    }
+    if(!surfaceBVH.isEmpty() && surfaceBVH.size() == boxes.size())
+        surfaceBVH.refit(boxes);
+    else
+        surfaceBVH.build(boxes);
+    const std::vector<int>& order = surfaceBVH.getOrder();
+    surfaceBatch.resize(order.size());
+    for(auto i = 0; i < order.size(); i++) {
+        RenderTriange tri = surfaceTrianges.at(order[i]);
+        surfaceBatch.set(i, { surfaceVertices.at(tri.a).pos,
+            surfaceVertices.at(tri.b).pos, surfaceVertices.at(tri.c).pos });
+    }
+}
+
+void Model::updateElementBVHs() {
+    std::vector<AABB> vertexBoxes(originalMesh.n_vertices());
+    for(auto vh : originalMesh.vertices())
+        vertexBoxes[vh.idx()].expand(vec3FromPoint(originalMesh.point(vh)));
+    std::vector<AABB> edgeBoxes(originalMesh.n_edges());
+    for(auto eh : originalMesh.edges()) {
+        edgeBoxes[eh.idx()].expand(vertexBoxes[eh.v0().idx()]);
+        edgeBoxes[eh.idx()].expand(vertexBoxes[eh.v1().idx()]);
+    }
+    std::vector<AABB> faceBoxes(originalMesh.n_faces());
+    for(auto fh : originalMesh.faces()) {
+        for(auto fvh : fh.vertices())
+            faceBoxes[fh.idx()].expand(vertexBoxes[fvh.idx()]);
+    }
+    // Same as the surface, moved elements only need a refit
+    std::pair<BVH*, std::vector<AABB>*> trees[] = {
+        { &vertexBVH, &vertexBoxes }, { &edgeBVH, &edgeBoxes }, { &faceBVH, &faceBoxes }
+    };
+    for(auto& tree : trees) {
+        if(!tree.first->isEmpty() && tree.first->size() == tree.second->size())
+            tree.first->refit(*tree.second);
+        else
+            tree.first->build(*tree.second);
+    }
+}
+
+float Model::raycastSurface(const Ray& ray, float maxDistance, PolyMesh::FaceHandle* face) const {
+    float nearest = maxDistance;
+    int nearestTri = -1;
+    // Whole leaves are tested at once, the batch is in their order
+    surfaceBVH.raycastLeaves(ray.origin, ray.direction, maxDistance, [&](int first, int count) {
+        int hit = rayTriangleIntersect(ray.origin, ray.direction, surfaceBatch, first, count, nearest);
+        if(hit == -1)
+            return -1.0f;
+        nearestTri = surfaceBVH.getOrder()[hit];
+        return nearest;
+    });
+    if(face != nullptr)
+        *face = nearestTri == -1 ? PolyMesh::InvalidFaceHandle :
+            PolyMesh::FaceHandle(surfaceFaces.at(nearestTri));
+    return nearest;
+}
+
+glm::vec4 Model::edgeColor(PolyMesh::EdgeHandle eh) const {
+    if(std::find(highlightedEdges.begin(), highlightedEdges.end(), eh) != highlightedEdges.end())
+        return glm::vec4(1.0f, 0.85f, 0.4f, 1.0f);
+    return originalMesh.status(eh).selected() ? glm::vec4(1.0f, 0.5f, 0.0f, 1.0f) :
+        glm::vec4(0.05f, 0.05f, 0.05f, 1.0f);
+}
+
+void Model::updateEdgeColor(DgDeviceContext context, PolyMesh::EdgeHandle eh) {
+    if(eh.idx() >= edgeWireframeVerts.size() || edgeWireframeVerts[eh.idx()] == -1)
+        return;
+    int first = edgeWireframeVerts[eh.idx()];
+    glm::vec4 color = edgeColor(eh);
+    for(int i = first; i < first + 8; i++)
+        wireframeVertices[i].color = color;
+    if(context != nullptr && wireframeVertexBuffer != nullptr)
+        context->UpdateBuffer(wireframeVertexBuffer, first * sizeof(RenderVertex),
+                              8 * sizeof(RenderVertex), &wireframeVertices[first],
+                              Diligent::RESOURCE_STATE_TRANSITION_MODE_TRANSITION);
+}
+
+void Model::highlightEdges(DgDeviceContext context, const std::vector<PolyMesh::EdgeHandle>& edges) {
+    std::vector<PolyMesh::EdgeHandle> previous = std::move(highlightedEdges);
+    highlightedEdges = edges;
+    for(auto eh : previous)
+        updateEdgeColor(context, eh);
+    for(auto eh : highlightedEdges)
+        updateEdgeColor(context, eh);
+}
+
 void Model::recreateWireframe(DgRenderDevice renderDevice, DgDeviceContext context,
                               float wireframeThickness) {
     std::vector<RenderVertex> wfVerts;
     std::vector<RenderTriange> wfTris;
     makeWireframe(wfVerts, wfTris, originalMesh, wireframeThickness);
-    
-    // Selection wireframe for raycasting
-    std::vector<RenderVertex> selWfRenderVerts;
-    std::vector<PolyMesh::EdgeHandle> selWfRenderVertsEdges;
-    selectionWireframeVerts.clear();
-    selectionWireframeTris.clear();
-    makeWireframe(selWfRenderVerts, selectionWireframeTris, originalMesh,
-                  wireframeThickness * 5.0f, &selWfRenderVertsEdges);
-    
-    selectionWireframeVerts.reserve(selWfRenderVerts.size() + surfaceVertices.size());
-    for(auto i = 0; i <  selWfRenderVerts.size(); i++) {
-        RenderVertex& renderVert = selWfRenderVerts.at(i);
-        PolyMesh::EdgeHandle edge = selWfRenderVertsEdges.at(i);
-        EdgeSelectionVertex selVert;
-        selVert.pos = renderVert.pos;
-        selVert.eh = edge;
-        selectionWireframeVerts.push_back(selVert);
-    }
-    int surfaceIndicesOffset = selWfRenderVerts.size();
-    for(auto i = 0; i < surfaceVertices.size(); i++) {
-        RenderVertex& renderVert = surfaceVertices.at(i);
-        EdgeSelectionVertex selVert;
-        selVert.pos = renderVert.pos;
-        selVert.eh = PolyMesh::InvalidEdgeHandle;
-        selectionWireframeVerts.push_back(selVert);
-    }
-    selectionWireframeTris.reserve(surfaceTrianges.size());
-    for(auto i = 0; i < surfaceTrianges.size(); i++) {
-        RenderTriange tri = surfaceTrianges.at(i);
-        tri.a += surfaceIndicesOffset;
-        tri.b += surfaceIndicesOffset;
-        tri.c += surfaceIndicesOffset;
-        selectionWireframeTris.push_back(tri);
+    // makeWireframe gives every edge 8 vertices, in edge order
+    edgeWireframeVerts.assign(originalMesh.n_edges(), -1);
+    int wfVertIndex = 0;
+    for(auto eh : originalMesh.edges()) {
+        edgeWireframeVerts[eh.idx()] = wfVertIndex;
+        wfVertIndex += 8;
+    }
+    for(auto eh : highlightedEdges) {
+        glm::vec4 color = edgeColor(eh);
+        for(int i = edgeWireframeVerts[eh.idx()]; i < edgeWireframeVerts[eh.idx()] + 8; i++)
+            wfVerts[i].color = color;
     }
     
     if(wfVerts.size() != lastNumWireframeVerts) {
@@ -538,6 +632,7 @@ void Model::recreateWireframe(DgRenderDevice renderDevice, DgDeviceContext conte
     numLinesIndices = wfTris.size() * 3;
     
     lastNumWireframeVerts = wfVerts.size();
+    wireframeVertices = std::move(wfVerts);
 }
 
 ModelRenderer::ModelRenderer(DgRenderDevice renderDevice, DgSwapChain swapChain, Texture& matcap,
@@ -823,14 +918,8 @@ void Editor::measureDistance() {
     if(model == nullptr)
         return;
     
-    PolyMesh& mesh = model->originalMesh;
-    float minDistance = 100000.0f;
-    for(auto vh : mesh.vertices()) {
-        float distance = glm::distance(eye, vec3FromPoint(mesh.point(vh)));
-        if(distance < minDistance)
-            minDistance = distance;
-    }
-    modelNearestPointDistance = minDistance;
+    float maxDistance = 100000.0f;
+    modelNearestPointDistance = sqrtf(model->vertexBVH.nearest(eye, maxDistance * maxDistance));
 }
 
 void Editor::recreateWireframeIfNeed(DgDeviceContext context) {
@@ -852,40 +941,400 @@ void Editor::invalidateModel(DgDeviceContext context) {
     model->invalidate(renderDevice, context, wireframeThickness);
 }
 
-void Editor::raycastEdges(glm::vec2 mouse, glm::vec2 screenDims, DgDeviceContext context) {
-    Ray ray = screenPointToRay(mouse, screenDims, viewProj);
+void Editor::subtractAsync(const PolyMesh& cutter) {
     if(model == nullptr)
         return;
-    std::vector<EdgeSelectionVertex>& verts = model->selectionWireframeVerts;
-    float minDistance = 100000;
-    EdgeSelectionVertex* closestVert = nullptr;
-    for(auto i = 0; i < model->selectionWireframeTris.size(); i++) {
-        RenderTriange tri = model->selectionWireframeTris.at(i);
-        glm::vec3 v0 = verts.at(tri.a).pos;
-        glm::vec3 v1 = verts.at(tri.b).pos;
-        glm::vec3 v2 = verts.at(tri.c).pos;
-        float distance = 0;
-        if(rayTriangleIntersect(ray.origin, ray.direction, v0, v1, v2, distance)) {
-            if(distance < minDistance) {
-                minDistance = distance;
-                closestVert = &verts.at(tri.a);
+    booleanCutter = cutter;
+    startBooleanJob();
+}
+
+void Editor::startBooleanJob() {
+    if(booleanJob != nullptr) {
+        booleanJob->cancel();
+        cancelledJobs.push_back(std::move(booleanJob));
+    }
+    booleanMeshVersion = model->meshVersion;
+    booleanJob.reset(new BooleanJob(model->originalMesh, booleanCutter, BooleanOperation::Subtract));
+}
+
+void Editor::pollBooleanJob(DgDeviceContext context) {
+    cancelledJobs.erase(std::remove_if(cancelledJobs.begin(), cancelledJobs.end(),
+                                       [](const std::unique_ptr<BooleanJob>& job) {
+                                           return job->isDone();
+                                       }),
+                        cancelledJobs.end());
+    if(model == nullptr || booleanJob == nullptr)
+        return;
+    // The model was edited after the snapshot, the result would undo that
+    if(model->meshVersion != booleanMeshVersion) {
+        startBooleanJob();
+        return;
+    }
+    if(!booleanJob->isFinished())
+        return;
+    model->originalMesh = booleanJob->takeResult();
+    booleanJob.reset();
+    invalidateModel(context);
+}
+
+static glm::vec2 clipToScreen(glm::vec4 clip, glm::vec2 screenDims) {
+    return glm::vec2((clip.x / clip.w + 1.0f) * 0.5f * screenDims.x,
+                     (1.0f - clip.y / clip.w) * 0.5f * screenDims.y);
+}
+
+void Editor::setCamera(glm::mat4 viewProj, glm::mat4 view) {
+    this->viewProj = viewProj;
+    this->view = view;
+    invViewProj = glm::inverse(viewProj);
+}
+
+Frustum Editor::makeScreenFrustum(glm::vec2 rectMin, glm::vec2 rectMax, glm::vec2 screenDims) const {
+    const float minW = 0.0001f;
+    // Clip space x of a point is dot(row0, p), so x >= left * w is a plane
+    // in world space, same for the other sides. Near cuts off what is
+    // behind the camera
+    glm::vec4 rows[4];
+    for(int i = 0; i < 4; i++)
+        rows[i] = glm::vec4(viewProj[0][i], viewProj[1][i], viewProj[2][i], viewProj[3][i]);
+    float left = rectMin.x / screenDims.x * 2.0f - 1.0f;
+    float right = rectMax.x / screenDims.x * 2.0f - 1.0f;
+    float top = 1.0f - rectMin.y / screenDims.y * 2.0f;
+    float bottom = 1.0f - rectMax.y / screenDims.y * 2.0f;
+    Frustum frustum;
+    frustum.planes = {
+        rows[0] - rows[3] * left, rows[3] * right - rows[0],
+        rows[1] - rows[3] * bottom, rows[3] * top - rows[1],
+        rows[3] - glm::vec4(0.0f, 0.0f, 0.0f, minW)
+    };
+    return frustum;
+}
+
+Editor::PickQuery Editor::makePickQuery(glm::vec2 mouse, glm::vec2 screenDims) const {
+    const float maxDistance = 100000.0f;
+    PickQuery query;
+    query.mouse = mouse;
+    query.screenDims = screenDims;
+    query.ray = screenPointToRayInverse(mouse, screenDims, invViewProj);
+    query.surfaceDistance = model->raycastSurface(query.ray, maxDistance, &query.face);
+    query.isOverSurface = query.surfaceDistance < maxDistance;
+    // The width of the tolerance at the depth of the surface, doubled
+    // for faces sloping away from the camera
+    query.depthSlack = 0.0f;
+    if(query.isOverSurface) {
+        float tolerance = std::max(edgePickTolerance, vertexPickTolerance);
+        Ray side = screenPointToRayInverse(mouse + glm::vec2(tolerance, 0.0f), screenDims, invViewProj);
+        query.depthSlack = 2.0f * glm::distance(query.ray.origin + query.ray.direction * query.surfaceDistance,
+                                                side.origin + side.direction * query.surfaceDistance);
+    }
+    return query;
+}
+
+float Editor::edgePixels(PolyMesh::EdgeHandle eh, const PickQuery& query) const {
+    const float minW = 0.0001f;
+    const float infinity = std::numeric_limits<float>::infinity();
+    const PolyMesh& mesh = model->originalMesh;
+    PolyMesh::HalfedgeHandle heh = mesh.halfedge_handle(eh, 0);
+    glm::vec3 a = vec3FromPoint(mesh.point(mesh.from_vertex_handle(heh)));
+    glm::vec3 b = vec3FromPoint(mesh.point(mesh.to_vertex_handle(heh)));
+    glm::vec4 clipA = viewProj * glm::vec4(a, 1.0f);
+    glm::vec4 clipB = viewProj * glm::vec4(b, 1.0f);
+    // Cut off the part behind the camera
+    if(clipA.w < minW && clipB.w < minW)
+        return infinity;
+    if(clipA.w < minW || clipB.w < minW) {
+        float f = (minW - clipA.w) / (clipB.w - clipA.w);
+        glm::vec4 clip = clipA + (clipB - clipA) * f;
+        glm::vec3 point = a + (b - a) * f;
+        if(clipA.w < minW) {
+            clipA = clip;
+            a = point;
+        } else {
+            clipB = clip;
+            b = point;
+        }
+    }
+    glm::vec2 screenA = clipToScreen(clipA, query.screenDims);
+    glm::vec2 screenB = clipToScreen(clipB, query.screenDims);
+    glm::vec2 segment = screenB - screenA;
+    float lengthSq = glm::dot(segment, segment);
+    float s = lengthSq > 0.0f ?
+        glm::clamp(glm::dot(query.mouse - screenA, segment) / lengthSq, 0.0f, 1.0f) : 0.0f;
+    // 1/w is linear on screen, so this is where s lands on the edge
+    float f = s * clipA.w / ((1.0f - s) * clipB.w + s * clipA.w);
+    glm::vec3 point = a + (b - a) * f;
+    if(glm::dot(point - query.ray.origin, query.ray.direction) > query.surfaceDistance + query.depthSlack)
+        return infinity;
+    return glm::distance(query.mouse, screenA + segment * s);
+}
+
+float Editor::vertexPixels(PolyMesh::VertexHandle vh, const PickQuery& query) const {
+    const float infinity = std::numeric_limits<float>::infinity();
+    glm::vec3 point = vec3FromPoint(model->originalMesh.point(vh));
+    glm::vec4 clip = viewProj * glm::vec4(point, 1.0f);
+    if(clip.w < 0.0001f)
+        return infinity;
+    if(glm::dot(point - query.ray.origin, query.ray.direction) > query.surfaceDistance + query.depthSlack)
+        return infinity;
+    return glm::distance(query.mouse, clipToScreen(clip, query.screenDims));
+}
+
+void Editor::queryPickCandidates(const BVH& bvh, glm::vec2 mouse, float tolerance,
+                                  glm::vec2 screenDims, std::vector<int>& out) const {
+    Frustum frustum = makeScreenFrustum(mouse - glm::vec2(tolerance), mouse + glm::vec2(tolerance),
+                                        screenDims);
+    std::vector<int> partial;
+    bvh.query([&](const AABB& box) { return frustum.classify(box); }, out, partial);
+    out.insert(out.end(), partial.begin(), partial.end());
+}
+
+PolyMesh::EdgeHandle Editor::pickEdge(glm::vec2 mouse, glm::vec2 screenDims,
+                                      bool* isOverSurface) const {
+    PolyMesh::EdgeHandle closestEdge = PolyMesh::InvalidEdgeHandle;
+    if(model == nullptr)
+        return closestEdge;
+    const PolyMesh& mesh = model->originalMesh;
+    PickQuery query = makePickQuery(mouse, screenDims);
+    if(isOverSurface != nullptr)
+        *isOverSurface = query.isOverSurface;
+    std::vector<int> candidates;
+    queryPickCandidates(model->edgeBVH, mouse, edgePickTolerance, screenDims, candidates);
+    float minPixels = edgePickTolerance;
+    for(int index : candidates) {
+        PolyMesh::EdgeHandle eh(index);
+        if(mesh.status(eh).deleted())
+            continue;
+        float pixels = edgePixels(eh, query);
+        if(pixels < minPixels) {
+            minPixels = pixels;
+            closestEdge = eh;
+        }
+    }
+    return closestEdge;
+}
+
+bool Hover::operator==(const Hover& other) const {
+    return kind == other.kind && vh == other.vh && eh == other.eh && fh == other.fh;
+}
+
+bool Hover::operator!=(const Hover& other) const {
+    return !(*this == other);
+}
+
+// Corners of what the hover is over
+static void addHoverVertices(const PolyMesh& mesh, const Hover& hover,
+                             std::vector<PolyMesh::VertexHandle>& out) {
+    switch(hover.kind) {
+        case HoverKind::Vertex:
+            out.push_back(hover.vh);
+            break;
+        case HoverKind::Edge:
+            out.push_back(mesh.from_vertex_handle(mesh.halfedge_handle(hover.eh, 0)));
+            out.push_back(mesh.to_vertex_handle(mesh.halfedge_handle(hover.eh, 0)));
+            break;
+        case HoverKind::Face:
+            for(auto fvh : mesh.cfv_range(hover.fh))
+                out.push_back(fvh);
+            break;
+        case HoverKind::None:
+            break;
+    }
+}
+
+void Editor::considerHover(const Hover& hit, float pixels, Hover& best, float& bestPixels) const {
+    if(pixels < bestPixels) {
+        best = hit;
+        bestPixels = pixels;
+    }
+}
+
+Hover Editor::resolveHover() const {
+    if(hoverVertex.kind != HoverKind::None)
+        return hoverVertex;
+    if(hoverEdge.kind != HoverKind::None)
+        return hoverEdge;
+    Hover faceHover;
+    if(hoverQuery.isOverSurface && hoverQuery.face.is_valid()) {
+        faceHover.kind = HoverKind::Face;
+        faceHover.fh = hoverQuery.face;
+    }
+    return faceHover;
+}
+
+void Editor::setHover(const Hover& newHover, DgDeviceContext context) {
+    if(newHover == hover)
+        return;
+    hover = newHover;
+    const PolyMesh& mesh = model->originalMesh;
+    std::vector<PolyMesh::EdgeHandle> edges;
+    switch(hover.kind) {
+        case HoverKind::Vertex:
+            for(auto veh : mesh.cve_range(hover.vh))
+                edges.push_back(veh);
+            break;
+        case HoverKind::Edge:
+            edges.push_back(hover.eh);
+            break;
+        case HoverKind::Face:
+            for(auto feh : mesh.cfe_range(hover.fh))
+                edges.push_back(feh);
+            break;
+        case HoverKind::None:
+            break;
+    }
+    model->highlightEdges(context, edges);
+}
+
+void Editor::hoverAt(glm::vec2 mouse, glm::vec2 screenDims) {
+    if(mouse == hoverMouse && screenDims == hoverScreenDims)
+        return;
+    hoverMouse = mouse;
+    hoverScreenDims = screenDims;
+    isHoverDirty = true;
+}
+
+void Editor::updateHover(DgDeviceContext context) {
+    if(model == nullptr)
+        return;
+    auto start = std::chrono::steady_clock::now();
+    const PolyMesh& mesh = model->originalMesh;
+    // Handles of the last hover mean nothing after the mesh changed
+    if(model->meshVersion != hoverMeshVersion) {
+        hoverMeshVersion = model->meshVersion;
+        hover = Hover();
+        isHoverDirty = true;
+    }
+    if(viewProj != hoverViewProj) {
+        hoverViewProj = viewProj;
+        isHoverDirty = true;
+    }
+    if(hoverScreenDims.x <= 0.0f || hoverScreenDims.y <= 0.0f)
+        return;
+    if(isHoverDirty) {
+        isHoverDirty = false;
+        hoverQuery = makePickQuery(hoverMouse, hoverScreenDims);
+        hoverVertex = Hover();
+        hoverEdge = Hover();
+        hoverVertexPixels = vertexPickTolerance;
+        hoverEdgePixels = edgePickTolerance;
+        // First guess: the surroundings of the last hover and of the face
+        // under the cursor, the cursor rarely gets far between two frames
+        std::vector<PolyMesh::VertexHandle> around;
+        addHoverVertices(mesh, hover, around);
+        if(hoverQuery.face.is_valid()) {
+            for(auto fvh : mesh.cfv_range(hoverQuery.face))
+                around.push_back(fvh);
+        }
+        for(auto vh : around) {
+            for(auto vvh : mesh.cvv_range(vh)) {
+                Hover hit;
+                hit.kind = HoverKind::Vertex;
+                hit.vh = vvh;
+                considerHover(hit, vertexPixels(vvh, hoverQuery), hoverVertex, hoverVertexPixels);
+            }
+            Hover hit;
+            hit.kind = HoverKind::Vertex;
+            hit.vh = vh;
+            considerHover(hit, vertexPixels(vh, hoverQuery), hoverVertex, hoverVertexPixels);
+            for(auto vfh : mesh.cvf_range(vh)) {
+                for(auto feh : mesh.cfe_range(vfh)) {
+                    Hover hit;
+                    hit.kind = HoverKind::Edge;
+                    hit.eh = feh;
+                    considerHover(hit, edgePixels(feh, hoverQuery), hoverEdge, hoverEdgePixels);
+                }
+            }
+            for(auto veh : mesh.cve_range(vh)) {
+                Hover hit;
+                hit.kind = HoverKind::Edge;
+                hit.eh = veh;
+                considerHover(hit, edgePixels(veh, hoverQuery), hoverEdge, hoverEdgePixels);
+            }
+        }
+        // The guess bounds how far the closest element can be, the BVHs are
+        // only asked for what is nearer. Edges within tolerance need not
+        // touch the face under the cursor, silhouette edges in front of it
+        // for one, so the guess alone is not the answer
+        if(model->vertexBVH.size() == mesh.n_vertices() && model->edgeBVH.size() == mesh.n_edges()) {
+            std::vector<int> candidates;
+            queryPickCandidates(model->vertexBVH, hoverMouse, hoverVertexPixels, hoverScreenDims,
+                                candidates);
+            for(int index : candidates) {
+                Hover hit;
+                hit.kind = HoverKind::Vertex;
+                hit.vh = PolyMesh::VertexHandle(index);
+                if(!mesh.status(hit.vh).deleted())
+                    considerHover(hit, vertexPixels(hit.vh, hoverQuery), hoverVertex, hoverVertexPixels);
+            }
+            candidates.clear();
+            queryPickCandidates(model->edgeBVH, hoverMouse, hoverEdgePixels, hoverScreenDims,
+                                candidates);
+            for(int index : candidates) {
+                Hover hit;
+                hit.kind = HoverKind::Edge;
+                hit.eh = PolyMesh::EdgeHandle(index);
+                if(!mesh.status(hit.eh).deleted())
+                    considerHover(hit, edgePixels(hit.eh, hoverQuery), hoverEdge, hoverEdgePixels);
             }
+            hoverScanNext = -1;
+            setHover(resolveHover(), context);
+            return;
         }
+        // The BVHs lag behind a mesh that was edited but not invalidated
+        // yet. All edges are scanned then, over as many frames as it takes,
+        // and the hover changes once at the end
+        hoverScanNext = 0;
     }
-    if(closestVert != nullptr) {
-        if(closestVert->eh != PolyMesh::InvalidEdgeHandle) {
-            if(!isShiftPressed) {
-                for(auto eh : model->originalMesh.edges())
-                    model->originalMesh.status(eh).set_selected(false);
+    if(hoverScanNext == -1)
+        return;
+    const int numEdges = mesh.n_edges();
+    const int chunkSize = 256;
+    while(hoverScanNext < numEdges) {
+        int end = std::min(hoverScanNext + chunkSize, numEdges);
+        for(int i = hoverScanNext; i < end; i++) {
+            PolyMesh::EdgeHandle eh(i);
+            if(mesh.status(eh).deleted())
+                continue;
+            Hover hit;
+            hit.kind = HoverKind::Edge;
+            hit.eh = eh;
+            considerHover(hit, edgePixels(eh, hoverQuery), hoverEdge, hoverEdgePixels);
+            for(int side = 0; side < 2; side++) {
+                Hover vertexHit;
+                vertexHit.kind = HoverKind::Vertex;
+                vertexHit.vh = side == 0 ? mesh.from_vertex_handle(mesh.halfedge_handle(eh, 0)) :
+                    mesh.to_vertex_handle(mesh.halfedge_handle(eh, 0));
+                considerHover(vertexHit, vertexPixels(vertexHit.vh, hoverQuery),
+                              hoverVertex, hoverVertexPixels);
             }
-            PolyMesh::StatusInfo& edgeStatus = model->originalMesh.status(closestVert->eh);
-            if(edgeStatus.selected())
-                edgeStatus.set_selected(false);
-            else
-                edgeStatus.set_selected(true);
-            invalidateModel(context);
         }
-    } else {
+        hoverScanNext = end;
+        std::chrono::duration<float, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        if(elapsed.count() > hoverBudget)
+            break;
+    }
+    if(hoverScanNext < numEdges)
+        return;
+    hoverScanNext = -1;
+    setHover(resolveHover(), context);
+}
+
+void Editor::raycastEdges(glm::vec2 mouse, glm::vec2 screenDims, DgDeviceContext context) {
+    if(model == nullptr)
+        return;
+    bool isOverSurface = false;
+    PolyMesh::EdgeHandle closestEdge = pickEdge(mouse, screenDims, &isOverSurface);
+    if(closestEdge.is_valid()) {
+        if(!isShiftPressed) {
+            for(auto eh : model->originalMesh.edges())
+                model->originalMesh.status(eh).set_selected(false);
+        }
+        PolyMesh::StatusInfo& edgeStatus = model->originalMesh.status(closestEdge);
+        if(edgeStatus.selected())
+            edgeStatus.set_selected(false);
+        else
+            edgeStatus.set_selected(true);
+        invalidateModel(context);
+    } else if(!isOverSurface) {
         if(!isShiftPressed) {
             bool doInvalidate = false;
             for(auto eh : model->originalMesh.edges()) {
@@ -900,6 +1349,216 @@ void Editor::raycastEdges(glm::vec2 mouse, glm::vec2 screenDims, DgDeviceContext
     }
 }
 
+// Even-odd rule
+static bool isInsidePolygon(glm::vec2 point, const std::vector<glm::vec2>& polygon) {
+    bool isInside = false;
+    for(int i = 0, j = (int)polygon.size() - 1; i < polygon.size(); j = i++) {
+        glm::vec2 a = polygon[i];
+        glm::vec2 b = polygon[j];
+        if((a.y > point.y) != (b.y > point.y) &&
+           point.x < a.x + (point.y - a.y) * (b.x - a.x) / (b.y - a.y))
+            isInside = !isInside;
+    }
+    return isInside;
+}
+
+// Clips the segment against the rectangle (Liang-Barsky)
+static bool segmentTouchesRect(glm::vec2 a, glm::vec2 b, glm::vec2 rectMin, glm::vec2 rectMax) {
+    glm::vec2 delta = b - a;
+    float enter = 0.0f;
+    float exit = 1.0f;
+    float p[] = { -delta.x, delta.x, -delta.y, delta.y };
+    float q[] = { a.x - rectMin.x, rectMax.x - a.x, a.y - rectMin.y, rectMax.y - a.y };
+    for(int i = 0; i < 4; i++) {
+        if(p[i] == 0.0f) {
+            if(q[i] < 0.0f)
+                return false;
+            continue;
+        }
+        float t = q[i] / p[i];
+        if(p[i] < 0.0f)
+            enter = std::max(enter, t);
+        else
+            exit = std::min(exit, t);
+    }
+    return enter <= exit;
+}
+
+static bool isRectInsidePolygon(glm::vec2 rectMin, glm::vec2 rectMax,
+                                const std::vector<glm::vec2>& polygon) {
+    glm::vec2 corners[] = { rectMin, glm::vec2(rectMax.x, rectMin.y), rectMax,
+        glm::vec2(rectMin.x, rectMax.y) };
+    for(auto corner : corners) {
+        if(!isInsidePolygon(corner, polygon))
+            return false;
+    }
+    // Corners inside are not enough for a concave polygon
+    for(int i = 0, j = (int)polygon.size() - 1; i < polygon.size(); j = i++) {
+        if(segmentTouchesRect(polygon[j], polygon[i], rectMin, rectMax))
+            return false;
+    }
+    return true;
+}
+
+void Editor::selectInRegion(const std::vector<glm::vec2>& region, bool isRectangle,
+                            glm::vec2 screenDims, DgDeviceContext context) {
+    const float minW = 0.0001f;
+    if(model == nullptr || region.size() < 3)
+        return;
+    PolyMesh& mesh = model->originalMesh;
+    glm::vec2 regionMin = region[0];
+    glm::vec2 regionMax = region[0];
+    for(auto point : region) {
+        regionMin = glm::min(regionMin, point);
+        regionMax = glm::max(regionMax, point);
+    }
+    // The sub-frustum under the bounds of the region
+    Frustum frustum = makeScreenFrustum(regionMin, regionMax, screenDims);
+    auto isPointInside = [&](glm::vec3 point) {
+        glm::vec4 clip = viewProj * glm::vec4(point, 1.0f);
+        if(clip.w < minW)
+            return false;
+        glm::vec2 screen = clipToScreen(clip, screenDims);
+        if(isRectangle)
+            return screen.x >= regionMin.x && screen.x <= regionMax.x &&
+                screen.y >= regionMin.y && screen.y <= regionMax.y;
+        return isInsidePolygon(screen, region);
+    };
+    auto classify = [&](const AABB& box) {
+        Overlap overlap = frustum.classify(box);
+        if(isRectangle || overlap != Overlap::Full)
+            return overlap;
+        // In front of the camera in full, so every corner projects
+        glm::vec2 boxMin(std::numeric_limits<float>::max());
+        glm::vec2 boxMax(-std::numeric_limits<float>::max());
+        for(int corner = 0; corner < 8; corner++) {
+            glm::vec3 point((corner & 1) ? box.max.x : box.min.x,
+                            (corner & 2) ? box.max.y : box.min.y,
+                            (corner & 4) ? box.max.z : box.min.z);
+            glm::vec2 screen = clipToScreen(viewProj * glm::vec4(point, 1.0f), screenDims);
+            boxMin = glm::min(boxMin, screen);
+            boxMax = glm::max(boxMax, screen);
+        }
+        return isRectInsidePolygon(boxMin, boxMax, region) ? Overlap::Full : Overlap::Partial;
+    };
+    
+    const BVH& bvh = selectionKind == SelectionKind::Vertices ? model->vertexBVH :
+        selectionKind == SelectionKind::Edges ? model->edgeBVH : model->faceBVH;
+    std::vector<int> full;
+    std::vector<int> partial;
+    bvh.query(classify, full, partial);
+    // Points of an element, and where on it the depth test looks
+    auto elementPoints = [&](int index, std::vector<glm::vec3>& points) {
+        points.clear();
+        if(selectionKind == SelectionKind::Vertices) {
+            points.push_back(vec3FromPoint(mesh.point(PolyMesh::VertexHandle(index))));
+        } else if(selectionKind == SelectionKind::Edges) {
+            PolyMesh::HalfedgeHandle heh = mesh.halfedge_handle(PolyMesh::EdgeHandle(index), 0);
+            points.push_back(vec3FromPoint(mesh.point(mesh.from_vertex_handle(heh))));
+            points.push_back(vec3FromPoint(mesh.point(mesh.to_vertex_handle(heh))));
+        } else {
+            for(auto fvh : mesh.cfv_range(PolyMesh::FaceHandle(index)))
+                points.push_back(vec3FromPoint(mesh.point(fvh)));
+        }
+    };
+    auto isDeleted = [&](int index) {
+        if(selectionKind == SelectionKind::Vertices)
+            return mesh.status(PolyMesh::VertexHandle(index)).deleted();
+        if(selectionKind == SelectionKind::Edges)
+            return mesh.status(PolyMesh::EdgeHandle(index)).deleted();
+        return mesh.status(PolyMesh::FaceHandle(index)).deleted();
+    };
+    std::vector<int> selected;
+    selected.reserve(full.size());
+    for(int index : full) {
+        if(!isDeleted(index))
+            selected.push_back(index);
+    }
+    std::vector<glm::vec3> points;
+    for(int index : partial) {
+        if(isDeleted(index))
+            continue;
+        elementPoints(index, points);
+        bool isInside = !points.empty();
+        for(auto& point : points)
+            isInside = isInside && isPointInside(point);
+        if(isInside)
+            selected.push_back(index);
+    }
+    
+    if(isSelectionDepthTested) {
+        // Looks from the eye at the middle of every element, on the pool
+        // since there can be a lot of them
+        std::vector<char> isVisible(selected.size(), 0);
+        const int minPerRun = 256;
+        ThreadPool& pool = ThreadPool::shared();
+        int runSize = std::max<int>(selected.size() / (4 * (pool.size() + 1)), minPerRun);
+        TaskGroup group(pool);
+        for(int first = 0; first < selected.size(); first += runSize) {
+            group.run([this, &selected, &isVisible, &elementPoints, first, runSize] {
+                std::vector<glm::vec3> runPoints;
+                int end = std::min<int>(first + runSize, selected.size());
+                for(int i = first; i < end; i++) {
+                    elementPoints(selected[i], runPoints);
+                    glm::vec3 middle(0.0f);
+                    for(auto& point : runPoints)
+                        middle += point;
+                    middle /= (float)runPoints.size();
+                    Ray ray;
+                    ray.origin = eye;
+                    float distance = glm::distance(eye, middle);
+                    if(distance <= 0.0f) {
+                        isVisible[i] = 1;
+                        continue;
+                    }
+                    ray.direction = (middle - eye) / distance;
+                    float slack = distance * 0.001f + 0.0001f;
+                    isVisible[i] = model->raycastSurface(ray, distance) >= distance - slack;
+                }
+            });
+        }
+        group.wait();
+        int numVisible = 0;
+        for(int i = 0; i < selected.size(); i++) {
+            if(isVisible[i])
+                selected[numVisible++] = selected[i];
+        }
+        selected.resize(numVisible);
+    }
+    
+    if(!isShiftPressed) {
+        for(auto vh : mesh.vertices())
+            mesh.status(vh).set_selected(false);
+        for(auto eh : mesh.edges())
+            mesh.status(eh).set_selected(false);
+        for(auto fh : mesh.faces())
+            mesh.status(fh).set_selected(false);
+    }
+    for(int index : selected) {
+        if(selectionKind == SelectionKind::Vertices)
+            mesh.status(PolyMesh::VertexHandle(index)).set_selected(true);
+        else if(selectionKind == SelectionKind::Edges)
+            mesh.status(PolyMesh::EdgeHandle(index)).set_selected(true);
+        else
+            mesh.status(PolyMesh::FaceHandle(index)).set_selected(true);
+    }
+    invalidateModel(context);
+}
+
+void Editor::selectInRectangle(glm::vec2 from, glm::vec2 to, glm::vec2 screenDims,
+                               DgDeviceContext context) {
+    glm::vec2 rectMin = glm::min(from, to);
+    glm::vec2 rectMax = glm::max(from, to);
+    std::vector<glm::vec2> region = { rectMin, glm::vec2(rectMax.x, rectMin.y), rectMax,
+        glm::vec2(rectMin.x, rectMax.y) };
+    selectInRegion(region, true, screenDims, context);
+}
+
+void Editor::selectInLasso(const std::vector<glm::vec2>& lasso, glm::vec2 screenDims,
+                           DgDeviceContext context) {
+    selectInRegion(lasso, false, screenDims, context);
+}
+
 void Editor::input(bool isMouseDown, float mouseX, float mouseY) {
     
 }
@@ -8,8 +8,10 @@
 #pragma once
 
 #include <Mesh.h>
+#include <BVH.h>
 #include <Diligent.h>
 #include <glm/glm.hpp>
+#include <memory>
 
 typedef Diligent::RefCntAutoPtr<Diligent::IRenderDevice> DgRenderDevice;
 typedef Diligent::RefCntAutoPtr<Diligent::IPipelineState> DgPipelineState;
@@ -39,6 +41,8 @@ struct Ray {
 };
 
 Ray screenPointToRay(glm::vec2 pos, glm::vec2 screenDims, glm::mat4 viewProj);
+// Same with the inverse of viewProj already at hand
+Ray screenPointToRayInverse(glm::vec2 pos, glm::vec2 screenDims, glm::mat4 invViewProj);
 
 struct RenderVertex {
     glm::vec3 pos;
@@ -55,14 +59,11 @@ struct RenderLine {
     int a, b;
 };
 
-struct EdgeSelectionVertex {
-    glm::vec3 pos;
-    PolyMesh::EdgeHandle eh;
-};
-
 class Model {
     void populateRenderBuffers(DgRenderDevice renderDevice, DgDeviceContext context,
                                float wireframeThickness);
+    void updateSurfaceBVH();
+    void updateElementBVHs();
     
     int lastNumVerts = 0;
     int lastNumTris = 0;
@@ -70,6 +71,16 @@ class Model {
     
     std::vector<RenderVertex> surfaceVertices;
     std::vector<RenderTriange> surfaceTrianges;
+    // Original face of every surface triangle
+    std::vector<int> surfaceFaces;
+    
+    std::vector<RenderVertex> wireframeVertices;
+    // Where the 8 vertices of every edge start in wireframeVertices, -1 for none
+    std::vector<int> edgeWireframeVerts;
+    std::vector<PolyMesh::EdgeHandle> highlightedEdges;
+    
+    glm::vec4 edgeColor(PolyMesh::EdgeHandle eh) const;
+    void updateEdgeColor(DgDeviceContext context, PolyMesh::EdgeHandle eh);
     
 public:
     Model();
@@ -77,12 +88,20 @@ public:
     PolyMesh originalMesh;
     PolyMesh renderMesh;
     
-    std::vector<EdgeSelectionVertex> selectionWireframeVerts;
-    std::vector<RenderTriange> selectionWireframeTris;
+    // Over the boxes of the surface triangles, for picking
+    BVH surfaceBVH;
+    // Surface triangles in the leaf order of surfaceBVH
+    TriangleBatch surfaceBatch;
+    // Over the vertices, edges and faces of originalMesh, indexed by
+    // their handle index. Deleted elements get empty boxes
+    BVH vertexBVH, edgeBVH, faceBVH;
     
     std::unordered_map<PolyMesh::VertexHandle, PolyMesh::VertexHandle> originalToRenderVerts;
     
     bool isFlatShaded = true;
+    // Bumped by invalidate, so caches built from originalMesh
+    // such as a BooleanOperand can tell whether it changed
+    uint64_t meshVersion = 0;
     
     DgBuffer vertexBuffer, triangleBuffer, wireframeTriangleBuffer, wireframeVertexBuffer;
     int numTrisIndices = 0;
@@ -91,6 +110,13 @@ public:
     void invalidate(DgRenderDevice renderDevice, DgDeviceContext context, float wireframeThickness = 0.02f);
     void recreateWireframe(DgRenderDevice renderDevice, DgDeviceContext context,
                            float wireframeThickness = 0.02f);
+    // Distance along the ray to the nearest surface triangle,
+    // maxDistance if there is none
+    float raycastSurface(const Ray& ray, float maxDistance = 100000.0f,
+                         PolyMesh::FaceHandle* face = nullptr) const;
+    // Draws only these edges highlighted. Touches just the wireframe
+    // vertices of edges that change, so it is cheap to call often
+    void highlightEdges(DgDeviceContext context, const std::vector<PolyMesh::EdgeHandle>& edges);
 };
 
 Model createCubeModel();
@@ -120,8 +146,87 @@ private:
     RendererObjects wireframe;
 };
 
+enum class SelectionKind {
+    Vertices,
+    Edges,
+    Faces
+};
+
+enum class HoverKind {
+    None,
+    Vertex,
+    Edge,
+    Face
+};
+
+struct Hover {
+    HoverKind kind = HoverKind::None;
+    PolyMesh::VertexHandle vh;
+    PolyMesh::EdgeHandle eh;
+    PolyMesh::FaceHandle fh;
+    
+    bool operator==(const Hover& other) const;
+    bool operator!=(const Hover& other) const;
+};
+
 class Editor {
+    // Everything picking needs to know about the cursor
+    struct PickQuery {
+        glm::vec2 mouse;
+        glm::vec2 screenDims;
+        Ray ray;
+        float surfaceDistance;
+        bool isOverSurface;
+        PolyMesh::FaceHandle face;
+        // How far behind the surface under the cursor
+        // something still counts as visible
+        float depthSlack;
+    };
+    
+    PickQuery makePickQuery(glm::vec2 mouse, glm::vec2 screenDims) const;
+    // Distances from the cursor on screen in pixels, infinity
+    // for what is hidden by the surface or behind the camera
+    float edgePixels(PolyMesh::EdgeHandle eh, const PickQuery& query) const;
+    float vertexPixels(PolyMesh::VertexHandle vh, const PickQuery& query) const;
+    // Sub-frustum under a rectangle on screen
+    Frustum makeScreenFrustum(glm::vec2 rectMin, glm::vec2 rectMax, glm::vec2 screenDims) const;
+    // Appends the elements of bvh that may be within tolerance pixels of
+    // the cursor, deleted ones included
+    void queryPickCandidates(const BVH& bvh, glm::vec2 mouse, float tolerance,
+                             glm::vec2 screenDims, std::vector<int>& out) const;
+    // Keeps the closer of hit and the best so far in best
+    void considerHover(const Hover& hit, float pixels, Hover& best, float& bestPixels) const;
+    // Selects what lies entirely inside the screen polygon. Rectangles
+    // need no test against the polygon, their sub-frustum is exact
+    void selectInRegion(const std::vector<glm::vec2>& region, bool isRectangle,
+                        glm::vec2 screenDims, DgDeviceContext context);
+    // Vertex over edge over face, from what was found so far
+    Hover resolveHover() const;
+    void setHover(const Hover& newHover, DgDeviceContext context);
+    
+    glm::mat4 invViewProj = glm::mat4(1.0f);
+    glm::mat4 hoverViewProj = glm::mat4(1.0f);
+    glm::vec2 hoverMouse = glm::vec2(0.0f);
+    glm::vec2 hoverScreenDims = glm::vec2(0.0f);
+    uint64_t hoverMeshVersion = 0;
+    bool isHoverDirty = false;
+    PickQuery hoverQuery;
+    // Closest vertex and edge found so far while scanning
+    Hover hoverVertex, hoverEdge;
+    float hoverVertexPixels = 0.0f;
+    float hoverEdgePixels = 0.0f;
+    // Next edge to scan, -1 when there is no scan going on
+    int hoverScanNext = -1;
+    
     float lastWireframeThickness = 0.02f;
+    // Cancelled jobs wait here until their threads stop,
+    // so cancelling never blocks a frame
+    std::vector<std::unique_ptr<BooleanJob>> cancelledJobs;
+    // What the running job subtracts and the version of the model it took,
+    // a job on an older model is started again on the current one
+    PolyMesh booleanCutter;
+    uint64_t booleanMeshVersion = 0;
+    void startBooleanJob();
 public:
     Editor(DgRenderDevice renderDevice, DgSwapChain swapChain, Texture& matcap,
            RendererCreateOptions options);
@@ -133,18 +238,66 @@ public:
     float wireframeThickness = 0.02f;
     float modelNearestPointDistance = 0.0f;
     
+    // Sets viewProj and view and caches the inverse of viewProj,
+    // call once per frame before anything is picked
+    void setCamera(glm::mat4 viewProj, glm::mat4 view);
+    
     Texture matcap;
     DgRenderDevice renderDevice;
     ModelRenderer renderer;
     
     bool isShiftPressed = false;
+    // How far from an edge on screen a click still picks it, in pixels
+    float edgePickTolerance = 6.0f;
     
+    // Edge closest to the cursor on screen within edgePickTolerance, among
+    // those not hidden behind the surface. Only edges edgeBVH finds under
+    // the cursor are measured. isOverSurface tells whether the cursor is
+    // over the model at all
+    PolyMesh::EdgeHandle pickEdge(glm::vec2 mouse, glm::vec2 screenDims,
+                                  bool* isOverSurface = nullptr) const;
     void raycastEdges(glm::vec2 mouse, glm::vec2 screenDims, DgDeviceContext context);
     
+    // What rectangle and lasso selection select
+    SelectionKind selectionKind = SelectionKind::Edges;
+    // Leaves out what the surface hides from the camera
+    bool isSelectionDepthTested = true;
+    // Select the elements lying entirely inside the rectangle between two
+    // corners or inside a closed lasso, both on screen. Shift adds to the
+    // selection, without it the selection is replaced
+    void selectInRectangle(glm::vec2 from, glm::vec2 to, glm::vec2 screenDims,
+                           DgDeviceContext context);
+    void selectInLasso(const std::vector<glm::vec2>& lasso, glm::vec2 screenDims,
+                       DgDeviceContext context);
+    
+    // How far from a vertex on screen the cursor still hovers it, in pixels
+    float vertexPickTolerance = 8.0f;
+    // Time updateHover may take per frame, in milliseconds
+    float hoverBudget = 1.0f;
+    // What the cursor is over as of the last updateHover
+    Hover hover;
+    // Remembers where the cursor is, picking waits for updateHover
+    void hoverAt(glm::vec2 mouse, glm::vec2 screenDims);
+    // Picks what is under the cursor if the cursor, the camera or the mesh
+    // changed and highlights it. Looks around the last hover and the face
+    // under the cursor first, then asks the element BVHs for anything
+    // closer. While they lag behind the mesh, all edges are scanned over
+    // as many frames as the budget needs instead. Call once per frame
+    void updateHover(DgDeviceContext context);
+    
     void measureDistance();
     void recreateWireframeIfNeed(DgDeviceContext context);
     void invalidateModel(DgDeviceContext context);
     
+    // Boolean running in the background on a snapshot of the model
+    std::unique_ptr<BooleanJob> booleanJob;
+    // Cancels the running job and starts subtracting cutter from the model,
+    // call again whenever the cutter moves
+    void subtractAsync(const PolyMesh& cutter);
+    // Swaps the result of a finished job into the model. A job started
+    // before the model last changed runs again instead. Call once per frame
+    void pollBooleanJob(DgDeviceContext context);
+    
     Model* model = nullptr;
     
     void input(bool isMouseDown, float mouseX, float mouseY);
@@ -7,7 +7,13 @@
 
 #include "Mesh.h"
 #include <OpenMesh/Core/Utils/Predicates.hh>
+#include <SpatialHash.h>
+#include <BVH.h>
 #include <unordered_map>
+#include <algorithm>
+#include <limits>
+#include <memory>
+#include <tuple>
 
 glm::vec3 vec3FromPoint(PolyMesh::Point p) {
     return glm::vec3(p[0], p[1], p[2]);
@@ -1244,196 +1250,122 @@ void bevel(PolyMesh& mesh, int segments, float radius, bool debug) {
     }
 }
 
-// I took it from OpenMesh sources
-std::vector<PolyMesh::FaceHandle> triangulateFace(PolyMesh::FaceHandle _fh, PolyMesh& mesh)
-{
-    std::vector<PolyMesh::FaceHandle> faces = { _fh };
-    PolyMesh::HalfedgeHandle base_heh(mesh.halfedge_handle(_fh));
-    PolyMesh::VertexHandle start_vh = mesh.from_vertex_handle(base_heh);
-    PolyMesh::HalfedgeHandle prev_heh(mesh.prev_halfedge_handle(base_heh));
-    PolyMesh::HalfedgeHandle next_heh(mesh.next_halfedge_handle(base_heh));
-    while (mesh.to_vertex_handle(mesh.next_halfedge_handle(next_heh)) != start_vh)
-    {
-        PolyMesh::HalfedgeHandle next_next_heh(mesh.next_halfedge_handle(next_heh));
-
-        PolyMesh::FaceHandle new_fh = mesh.new_face();
-        mesh.set_halfedge_handle(new_fh, base_heh);
-
-        PolyMesh::HalfedgeHandle new_heh = mesh.new_edge(mesh.to_vertex_handle(next_heh), start_vh);
-
-        mesh.set_next_halfedge_handle(base_heh, next_heh);
-        mesh.set_next_halfedge_handle(next_heh, new_heh);
-        mesh.set_next_halfedge_handle(new_heh, base_heh);
-
-        mesh.set_face_handle(base_heh, new_fh);
-        mesh.set_face_handle(next_heh, new_fh);
-        mesh.set_face_handle(new_heh,  new_fh);
-
-        mesh.copy_all_properties(prev_heh, new_heh, true);
-        mesh.copy_all_properties(prev_heh, mesh.opposite_halfedge_handle(new_heh), true);
-        mesh.copy_all_properties(_fh, new_fh, true);
-
-        base_heh = mesh.opposite_halfedge_handle(new_heh);
-        next_heh = next_next_heh;
-        
-        faces.push_back(new_fh);
-    }
-    mesh.set_halfedge_handle(_fh, base_heh);  //the last face takes the handle _fh
-
-    mesh.set_next_halfedge_handle(base_heh, next_heh);
-    mesh.set_next_halfedge_handle(mesh.next_halfedge_handle(next_heh), base_heh);
-
-    mesh.set_face_handle(base_heh, _fh);
+// Triangles of the faces of a mesh, made without adding anything to it.
+// Every face is fanned from the first vertex of its halfedge, the same
+// split OpenMesh triangulate() makes, and the triangles of all faces are kept
+// in one batch. A face changed after that has to be invalidated
+class FaceTriangulation {
+public:
+    FaceTriangulation(const PolyMesh& mesh);
+    
+    // Range of the triangles of the face in the batch, triangulates the face
+    // again first if it was invalidated. Deleted faces have no triangles
+    void triangles(PolyMesh::FaceHandle fh, int& first, int& count);
+    // Same for a face that was not invalidated, safe from several threads
+    void triangles(PolyMesh::FaceHandle fh, int& first, int& count) const;
+    void invalidate(PolyMesh::FaceHandle fh);
+    const TriangleBatch& getBatch() const;
+    
+private:
+    struct Span {
+        int first = 0;
+        int count = 0;
+        int capacity = 0;
+        bool isValid = false;
+    };
     
-    return faces;
-}
+    void triangulate(PolyMesh::FaceHandle fh, Span& span);
+    
+    const PolyMesh& mesh;
+    std::vector<Span> spans;
+    TriangleBatch batch;
+};
 
-PolyMesh::FaceHandle copyFace(PolyMesh::FaceHandle fh, PolyMesh& mesh) {
-    std::vector<PolyMesh::VertexHandle> faceVerts;
-    for(auto fvhIt = mesh.fv_ccwiter(fh); fvhIt.is_valid(); fvhIt++) {
-        faceVerts.push_back(mesh.add_vertex(mesh.point(*fvhIt)));
-    }
-    PolyMesh::FaceHandle copyFh = mesh.add_face(faceVerts);
-    return copyFh;
+FaceTriangulation::FaceTriangulation(const PolyMesh& mesh):
+    mesh(mesh) {
+    spans.resize(mesh.n_faces());
+    for(auto fh : mesh.faces())
+        triangulate(fh, spans[fh.idx()]);
 }
 
-struct TriTriIntersect {
-    glm::vec3 a, b;
-    bool intersects = false;
-};
+void FaceTriangulation::triangles(PolyMesh::FaceHandle fh, int& first, int& count) {
+    // Faces added after the constructor
+    if(fh.idx() >= spans.size())
+        spans.resize(mesh.n_faces());
+    Span& span = spans[fh.idx()];
+    if(!span.isValid)
+        triangulate(fh, span);
+    first = span.first;
+    count = span.count;
+}
 
-struct TrianglePoints {
-    glm::vec3 a, b, c;
-};
+void FaceTriangulation::triangles(PolyMesh::FaceHandle fh, int& first, int& count) const {
+    const Span& span = spans[fh.idx()];
+    assert(span.isValid);
+    first = span.first;
+    count = span.count;
+}
 
-TrianglePoints getTrianglePoints(PolyMesh::FaceHandle fh, PolyMesh& mesh) {
-    TrianglePoints points;
-    std::vector<glm::vec3> pointsVec;
-    for(auto fvh : mesh.fv_cw_range(fh))
-        pointsVec.push_back(vec3FromPoint(mesh.point(fvh)));
-    points.a = pointsVec[0];
-    points.b = pointsVec[1];
-    points.c = pointsVec[2];
-    return points;
+void FaceTriangulation::invalidate(PolyMesh::FaceHandle fh) {
+    if(fh.idx() < spans.size())
+        spans[fh.idx()].isValid = false;
 }
 
-// https://www.scratchapixel.com/lessons/3d-basic-rendering/ray-tracing-rendering-a-triangle/ray-triangle-intersection-geometric-solution
-bool rayTriangleIntersect(
-    const glm::vec3 &orig, const glm::vec3 &dir,
-    const glm::vec3 &v0, const glm::vec3 &v1, const glm::vec3 &v2,
-    float &t)
-{
-    // compute plane's normal
-    glm::vec3 v0v1 = v1 - v0;
-    glm::vec3 v0v2 = v2 - v0;
-    // no need to normalize
-    glm::vec3 N = glm::cross(v0v1, v0v2);  //N
-    float area2 = glm::length(N);
- 
-    // Step 1: finding P
- 
-    // check if ray and plane are parallel ?
-    float NdotRayDirection = glm::dot(N, dir);
-    if (fabs(NdotRayDirection) < 0.0001f)  //almost 0
-        return false;  //they are parallel so they don't intersect !
- 
-    // compute d parameter using equation 2
-    float d = glm::dot(-N, v0);
- 
-    // compute t (equation 3)
-    t = -(glm::dot(N, orig) + d) / NdotRayDirection;
- 
-    // check if the triangle is in behind the ray
-    if (t < 0.0f) return false;  //the triangle is behind
- 
-    // compute the intersection point using equation 1
-    glm::vec3 P = orig + t * dir;
- 
-    // Step 2: inside-outside test
-    glm::vec3 C;  //vector perpendicular to triangle's plane
- 
-    // edge 0
-    glm::vec3 edge0 = v1 - v0;
-    glm::vec3 vp0 = P - v0;
-    C = glm::cross(edge0, vp0);
-    if (glm::dot(N, C) < 0) return false;  //P is on the right side
- 
-    // edge 1
-    glm::vec3 edge1 = v2 - v1;
-    glm::vec3 vp1 = P - v1;
-    C = glm::cross(edge1, vp1);
-    if (glm::dot(N, C) < 0)  return false;  //P is on the right side
- 
-    // edge 2
-    glm::vec3 edge2 = v0 - v2;
-    glm::vec3 vp2 = P - v2;
-    C = glm::cross(edge2, vp2);
-    if (glm::dot(N, C) < 0) return false;  //P is on the right side;
- 
-    return true;  //this ray hits the triangle
-}
-
-struct RayTriFromLine {
-    glm::vec3 orig, dir;
-    TrianglePoints& tri;
-    RayTriFromLine(glm::vec3 a, glm::vec3 b, TrianglePoints& tri): tri(tri), orig(a) {
-        dir = glm::normalize(b - a);
-    }
-};
+const TriangleBatch& FaceTriangulation::getBatch() const {
+    return batch;
+}
 
-TriTriIntersect triTriIntersect(TrianglePoints triA, TrianglePoints triB) {
-    std::vector<glm::vec3> points;
-    std::array<RayTriFromLine, 6> rays = {
-        RayTriFromLine(triA.a, triA.b, triB),
-        RayTriFromLine(triA.a, triA.c, triB),
-        RayTriFromLine(triA.b, triA.c, triB),
-        RayTriFromLine(triB.a, triB.b, triA),
-        RayTriFromLine(triB.a, triB.c, triA),
-        RayTriFromLine(triB.b, triB.c, triA)
-    };
-    for(auto& ray : rays) {
-        float t = 0;
-        if(rayTriangleIntersect(ray.orig, ray.dir, ray.tri.a, ray.tri.b, ray.tri.c, t))
-            points.push_back(ray.orig + ray.dir * t);
-    }
-    TriTriIntersect inter;
-    if(points.size() == 2) {
-        inter.intersects = true;
-        inter.a = points[0];
-        inter.b = points[1];
-    }
-    return inter;
+void FaceTriangulation::triangulate(PolyMesh::FaceHandle fh, Span& span) {
+    span.isValid = true;
+    span.count = 0;
+    if(mesh.has_face_status() && mesh.status(fh).deleted())
+        return;
+    PolyMesh::HalfedgeHandle baseHeh = mesh.halfedge_handle(fh);
+    glm::vec3 start = vec3FromPoint(mesh.point(mesh.from_vertex_handle(baseHeh)));
+    PolyMesh::HalfedgeHandle heh = mesh.next_halfedge_handle(baseHeh);
+    int count = (int)mesh.valence(fh) - 2;
+    // Rewrite in place when the face got no more triangles than
+    // it had, otherwise move to the end of the batch
+    if(count > span.capacity) {
+        span.first = batch.size();
+        span.capacity = count;
+        batch.resize(batch.size() + count);
+    }
+    for(int i = 0; i < count; i++) {
+        TrianglePoints tri;
+        tri.a = start;
+        tri.b = vec3FromPoint(mesh.point(mesh.from_vertex_handle(heh)));
+        tri.c = vec3FromPoint(mesh.point(mesh.to_vertex_handle(heh)));
+        batch.set(span.first + i, tri);
+        heh = mesh.next_halfedge_handle(heh);
+    }
+    span.count = count;
 }
 
 struct LineSeg {
     glm::vec3 a, b;
 };
 
-std::list<LineSeg> faceFaceIntersect(PolyMesh::FaceHandle faceA, PolyMesh& meshA,
-                          PolyMesh::FaceHandle faceB, PolyMesh& meshB) {
-    PolyMesh::FaceHandle copyFaceA = copyFace(faceA, meshA);
-    std::vector<PolyMesh::FaceHandle> aTris = triangulateFace(copyFaceA, meshA);
-    PolyMesh::FaceHandle copyFaceB = copyFace(faceB, meshB);
-    std::vector<PolyMesh::FaceHandle> bTris = triangulateFace(copyFaceB, meshB);
-    std::list<LineSeg> segs;
-    for(auto triA : aTris) {
-        TrianglePoints triPtsA = getTrianglePoints(triA, meshA);
-        for(auto triB : bTris) {
-            TrianglePoints triPtsB = getTrianglePoints(triB, meshB);
-            TriTriIntersect intersect = triTriIntersect(triPtsA, triPtsB);
-            if(intersect.intersects) {
-                LineSeg seg;
-                seg.a = intersect.a;
-                seg.b = intersect.b;
-                segs.push_back(seg);
-            }
-        }
+// Appends the segments where the faces cross, reads the triangulations only
+void faceFaceIntersect(PolyMesh::FaceHandle faceA, const FaceTriangulation& trianglesA,
+                       PolyMesh::FaceHandle faceB, const FaceTriangulation& trianglesB,
+                       std::vector<LineSeg>& out) {
+    int firstA = 0, numTrisA = 0;
+    int firstB = 0, numTrisB = 0;
+    trianglesA.triangles(faceA, firstA, numTrisA);
+    trianglesB.triangles(faceB, firstB, numTrisB);
+    std::vector<TriTriHit> hits;
+    for(int i = firstA; i < firstA + numTrisA; i++)
+        triTriIntersect(trianglesA.getBatch().get(i), trianglesB.getBatch(), firstB, numTrisB, hits);
+    for(auto& hit : hits) {
+        // Coplanar overlaps and touching at a single point cut nothing
+        if(hit.intersect.isCoplanar || glm::distance(hit.intersect.a, hit.intersect.b) < 0.0001f)
+            continue;
+        LineSeg seg;
+        seg.a = hit.intersect.a;
+        seg.b = hit.intersect.b;
+        out.push_back(seg);
     }
-    for(auto tri : aTris)
-        meshA.delete_face(tri);
-    for(auto tri : bTris)
-        meshB.delete_face(tri);
-    return segs;
 }
 
 struct LineSegI {
@@ -1465,23 +1397,15 @@ bool isPointLyingOnTriangle(glm::vec3 point, glm::vec3 v1, glm::vec3 v2, glm::ve
     return offset < threshold;
 }
 
-bool isPointLyingOnFace(glm::vec3 point, PolyMesh::FaceHandle fh, PolyMesh& mesh,
+bool isPointLyingOnFace(glm::vec3 point, PolyMesh::FaceHandle fh, FaceTriangulation& triangles,
                         float threshold = 0.01f) {
-    PolyMesh::FaceHandle copyFh = copyFace(fh, mesh);
-    std::vector<PolyMesh::FaceHandle> tris = triangulateFace(copyFh, mesh);
-    for(auto tri : tris) {
-        std::vector<glm::vec3> triPoints;
-        triPoints.reserve(3);
-        for(auto fvh : mesh.fv_range(tri))
-            triPoints.push_back(vec3FromPoint(mesh.point(fvh)));
-        if(isPointLyingOnTriangle(point, triPoints[0], triPoints[1], triPoints[2]), threshold) {
-            for(auto tri : tris)
-                mesh.delete_face(tri);
+    int first = 0, numTris = 0;
+    triangles.triangles(fh, first, numTris);
+    for(int i = first; i < first + numTris; i++) {
+        TrianglePoints tri = triangles.getBatch().get(i);
+        if(isPointLyingOnTriangle(point, tri.a, tri.b, tri.c, threshold))
             return true;
-        }
     }
-    for(auto tri : tris)
-        mesh.delete_face(tri);
     return false;
 }
 
@@ -1611,6 +1535,35 @@ TwoFacesVerts cutFace(std::list<PolyMesh::VertexHandle> verts, PolyMesh::FaceHan
     return twoFaces;
 }
 
+static int findRoot(std::vector<int>& parents, int i) {
+    while(parents[i] != i) {
+        parents[i] = parents[parents[i]];
+        i = parents[i];
+    }
+    return i;
+}
+
+// Hierarchy over the boxes of the faces, padded so that faces
+// that only touch still overlap. faces maps box indices to faces
+BVH buildFaceBVH(PolyMesh& mesh, std::vector<PolyMesh::FaceHandle>& faces,
+                 float padding = 0.0001f) {
+    std::vector<AABB> boxes;
+    boxes.reserve(mesh.n_faces());
+    faces.clear();
+    faces.reserve(mesh.n_faces());
+    for(auto fh : mesh.faces()) {
+        AABB box;
+        for(auto fvh : fh.vertices_ccw())
+            box.expand(vec3FromPoint(mesh.point(fvh)));
+        box.pad(padding);
+        boxes.push_back(box);
+        faces.push_back(fh);
+    }
+    BVH bvh;
+    bvh.build(boxes);
+    return bvh;
+}
+
 // 1. Пройтись по всем граням первой полисетки и найти пересечения
 //    с граниями второй полисетки.
 // 2. У сегментов пересечения объединить вершины, которые находятся
@@ -1625,81 +1578,107 @@ void intersectMeshesOld(PolyMesh& a, PolyMesh& b) {
     std::list<LineSegI> segs;
     std::list<LineSegI*> pathHeads;
     // 1.
-    std::list<std::pair<PolyMesh::FaceHandle, PolyMesh::FaceHandle>> faces;
     std::list<PolyMesh::FaceHandle> aFaces;
     for(auto faceA : a.faces())
         aFaces.push_back(faceA);
-    for(auto faceA : a.faces()) {
-        // TODO: replace with BVH traversal
-        for(auto faceB : b.faces()) {
-            faces.push_back(std::make_pair(faceA, faceB));
+    // Only faces whose boxes overlap can intersect. Pairs come out of
+    // the hierarchies in the order the nested loop over faces gave them
+    std::vector<PolyMesh::FaceHandle> facesA, facesB;
+    BVH bvhA = buildFaceBVH(a, facesA);
+    BVH bvhB = buildFaceBVH(b, facesB);
+    std::vector<std::pair<int, int>> overlaps;
+    bvhA.queryOverlaps(bvhB, overlaps);
+    std::sort(overlaps.begin(), overlaps.end());
+    std::vector<std::pair<PolyMesh::FaceHandle, PolyMesh::FaceHandle>> faces;
+    faces.reserve(overlaps.size());
+    for(auto& overlap : overlaps)
+        faces.push_back(std::make_pair(facesA[overlap.first], facesB[overlap.second]));
+    FaceTriangulation trianglesA(a);
+    FaceTriangulation trianglesB(b);
+    // Pairs are intersected on the pool in runs that only read the
+    // triangulations, every run into a buffer of its own. Vertices
+    // are made in step 2 on this thread, in pair order
+    struct PairSegs {
+        std::vector<int> pairs;
+        std::vector<LineSeg> segs;
+    };
+    const int minPairsPerRun = 64;
+    ThreadPool& pool = ThreadPool::shared();
+    int runSize = std::max<int>(faces.size() / (4 * (pool.size() + 1)), minPairsPerRun);
+    std::vector<PairSegs> runs((faces.size() + runSize - 1) / runSize);
+    {
+        const FaceTriangulation& readA = trianglesA;
+        const FaceTriangulation& readB = trianglesB;
+        TaskGroup group(pool);
+        for(int run = 0; run < runs.size(); run++) {
+            group.run([&faces, &runs, &readA, &readB, run, runSize] {
+                PairSegs& out = runs[run];
+                int end = std::min<int>((run + 1) * runSize, faces.size());
+                for(int i = run * runSize; i < end; i++) {
+                    faceFaceIntersect(faces[i].first, readA, faces[i].second, readB, out.segs);
+                    out.pairs.resize(out.segs.size(), i);
+                }
+            });
         }
+        group.wait();
     }
-    for(auto pair : faces) {
-        auto faceA = pair.first;
-        auto faceB = pair.second;
-        auto segList = faceFaceIntersect(faceA, a, faceB, b);
-        for(auto seg : segList) {
-            segs.push_back(LineSegI(a.add_vertex(vec3ToPoint(seg.a)),
-                                    a.add_vertex(vec3ToPoint(seg.b)), faceA, faceB));
+    // 2. Endpoints closer than threshold become one vertex. Neighbours come
+    //    from a hash of cells and are joined in a union-find, so chains of
+    //    close endpoints end up together. Vertices are made only after that
+    float threshold = 0.0001f;
+    std::vector<glm::vec3> endpoints;
+    for(auto& run : runs) {
+        for(auto& seg : run.segs) {
+            endpoints.push_back(seg.a);
+            endpoints.push_back(seg.b);
         }
     }
-//    std::list<std::pair<glm::vec3, int>> cutPositions;
-//    for(auto& seg : segs) {
-//        cutPositions.push_back(std::make_pair(vec3FromPoint(a.point(seg.v1)), seg.v1.idx()));
-//        cutPositions.push_back(std::make_pair(vec3FromPoint(a.point(seg.v2)), seg.v2.idx()));
-//    }
-    // 2.
-    float threshold = 0.0001f;
+    std::vector<int> parents(endpoints.size());
+    for(int i = 0; i < endpoints.size(); i++)
+        parents[i] = i;
+    // Cells twice the threshold keep a lookup within 8 of them
+    SpatialHash hash(threshold * 2);
+    hash.build(endpoints);
+    std::vector<int> candidates;
+    for(int i = 0; i < endpoints.size(); i++) {
+        candidates.clear();
+        hash.queryRadius(endpoints[i], threshold, candidates);
+        for(int j : candidates) {
+            if(j <= i || glm::distance(endpoints[i], endpoints[j]) >= threshold)
+                continue;
+            int rootI = findRoot(parents, i);
+            int rootJ = findRoot(parents, j);
+            // The lowest endpoint is the root, so it comes first below
+            if(rootI != rootJ)
+                parents[std::max(rootI, rootJ)] = std::min(rootI, rootJ);
+        }
+    }
+    std::vector<PolyMesh::VertexHandle> endpointVerts(endpoints.size());
+    for(int i = 0; i < endpoints.size(); i++) {
+        int root = findRoot(parents, i);
+        endpointVerts[i] = root == i ? a.add_vertex(vec3ToPoint(endpoints[i])) : endpointVerts[root];
+    }
     std::unordered_map<int, std::vector<LineSegI*>> verts;
     std::unordered_map<int, bool> knownVerts;
     std::list<int> vertList;
-    for(auto& seg1 : segs) {
-        for(auto& seg2 : segs) {
-            if((a.point(seg1.v1) - a.point(seg2.v1)).length() < threshold) {
-                a.delete_vertex(seg2.v1);
-                seg2.v1 = seg1.v1;
-                verts[seg1.v1.idx()].push_back(&seg1);
-                verts[seg1.v1.idx()].push_back(&seg2);
-                vertList.push_back(seg1.v1.idx());
-                continue;
-            }
-            if((a.point(seg1.v2) - a.point(seg2.v1)).length() < threshold) {
-                a.delete_vertex(seg2.v1);
-                seg2.v1 = seg1.v2;
-                verts[seg1.v2.idx()].push_back(&seg1);
-                verts[seg1.v2.idx()].push_back(&seg2);
-                vertList.push_back(seg1.v2.idx());
-                continue;
-            }
-            if((a.point(seg1.v2) - a.point(seg2.v2)).length() < threshold) {
-                a.delete_vertex(seg2.v2);
-                seg2.v2 = seg1.v2;
-                verts[seg1.v2.idx()].push_back(&seg1);
-                verts[seg1.v2.idx()].push_back(&seg2);
-                vertList.push_back(seg1.v2.idx());
-                continue;
-            }
-            if((a.point(seg1.v1) - a.point(seg2.v2)).length() < threshold) {
-                a.delete_vertex(seg2.v2);
-                seg2.v2 = seg1.v1;
-                verts[seg1.v1.idx()].push_back(&seg1);
-                verts[seg1.v1.idx()].push_back(&seg2);
-                vertList.push_back(seg1.v1.idx());
+    int endpoint = 0;
+    for(auto& run : runs) {
+        for(int i = 0; i < run.segs.size(); i++) {
+            PolyMesh::VertexHandle v1 = endpointVerts[endpoint++];
+            PolyMesh::VertexHandle v2 = endpointVerts[endpoint++];
+            // Both ends were merged into one vertex
+            if(v1 == v2)
                 continue;
+            auto& pair = faces[run.pairs[i]];
+            segs.push_back(LineSegI(v1, v2, pair.first, pair.second));
+            for(auto vh : { v1, v2 }) {
+                auto& adjacentSegs = verts[vh.idx()];
+                if(adjacentSegs.empty())
+                    vertList.push_back(vh.idx());
+                adjacentSegs.push_back(&segs.back());
             }
         }
     }
-    for(auto& seg : segs) {
-        if(verts[seg.v1.idx()].size() == 0) {
-            verts[seg.v1.idx()].push_back(&seg);
-            vertList.push_back(seg.v1.idx());
-        }
-        if(verts[seg.v2.idx()].size() == 0) {
-            verts[seg.v2.idx()].push_back(&seg);
-            vertList.push_back(seg.v2.idx());
-        }
-    }
     // 3, 4.
     for(int vertInd : vertList) {
         // Is it unknown start or end of path
@@ -1756,7 +1735,7 @@ void intersectMeshesOld(PolyMesh& a, PolyMesh& b) {
         centroid /= cut.verts.size();
         PolyMesh::FaceHandle fh = PolyMesh::InvalidFaceHandle;
         for(auto faceA : aFaces) {
-            if(isPointLyingOnFace(centroid, faceA, a)) {
+            if(isPointLyingOnFace(centroid, faceA, trianglesA)) {
                 fh = faceA;
                 break;
             }
@@ -1767,6 +1746,7 @@ void intersectMeshesOld(PolyMesh& a, PolyMesh& b) {
         PolyMesh::Point faceNormal = a.normal(fh);
         auto newFacesVerts = cutFace(cut.verts, fh, a);
         a.delete_face(fh);
+        trianglesA.invalidate(fh);
         auto newFace1 = a.add_face(newFacesVerts.first);
         auto newFace2 = a.add_face(newFacesVerts.second);
 //        a.set_normal(newFace1, faceNormal);
@@ -1941,25 +1921,98 @@ void CSGPlane::flip() {
     this->w = -this->w;
 }
 
-void CSGPlane::splitPolygon(CSGPolygon& polygon,
-                  std::list<CSGPolygon>& coplanarFront,
-                  std::list<CSGPolygon>& coplanarBack,
-                  std::list<CSGPolygon>& front,
-                  std::list<CSGPolygon>& back) {
-    static constexpr int Coplanar = 0;
-    static constexpr int Front = 1;
-    static constexpr int Back = 2;
-    static constexpr int Spanning = 3;
-    int polygonType = 0;
-    std::vector<int> vertTypes;
-    for (int i = 0; i < polygon.verts.size(); i++) {
-        // Distance from the plane to the vertex
+EdgeSplitCache::EdgeSplitCache(const EdgeSplitCache* parent):
+    parent(parent) {}
+
+EdgeSplitCache::Key EdgeSplitCache::makeKey(CSGVertex* a, CSGVertex* b,
+                                            const CSGPlane* plane) {
+    if(b != nullptr && b < a)
+        std::swap(a, b);
+    return { a, b, plane };
+}
+
+bool EdgeSplitCache::Key::operator==(const Key& other) const {
+    return a == other.a && b == other.b && plane == other.plane;
+}
+
+size_t EdgeSplitCache::KeyHash::operator()(const Key& key) const {
+    size_t hash = std::hash<CSGVertex*>()(key.a);
+    hash ^= std::hash<CSGVertex*>()(key.b) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+    hash ^= std::hash<const CSGPlane*>()(key.plane) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+    return hash;
+}
+
+CSGVertex* EdgeSplitCache::find(CSGVertex* a, CSGVertex* b,
+                                const CSGPlane* plane) const {
+    Key key = makeKey(a, b, plane);
+    for(const EdgeSplitCache* cache = this; cache != nullptr; cache = cache->parent) {
+        auto it = cache->splits.find(key);
+        if(it != cache->splits.end())
+            return it->second;
+    }
+    return nullptr;
+}
+
+void EdgeSplitCache::insert(CSGVertex* a, CSGVertex* b, const CSGPlane* plane,
+                            CSGVertex* split) {
+    splits.emplace(makeKey(a, b, plane), split);
+}
+
+void EdgeSplitCache::merge(EdgeSplitCache& other) {
+    if(splits.empty()) {
+        splits.swap(other.splits);
+        return;
+    }
+    splits.insert(other.splits.begin(), other.splits.end());
+    other.splits.clear();
+}
+
+size_t EdgeSplitCache::size() const {
+    return splits.size();
+}
+
+int CSGPlane::classifyPolygon(const CSGPolygon& polygon) const {
+    int polygonType = Coplanar;
+    for (int i = 0; i < polygon.numVerts; i++) {
         float t = glm::dot(this->normal, polygon.verts[i]->pos) - this->w;
-        int type = (t < -Threshold) ? Back : (t < Threshold) ? Coplanar : Front;
+        polygonType |= (t < -Threshold) ? Back : (t < Threshold) ? Coplanar : Front;
+        if(polygonType == Spanning)
+            break;
+    }
+    return polygonType;
+}
+
+void CSGPlane::splitPolygon(const CSGPolygon& polygon,
+                  CSGPolygonList& coplanarFront,
+                  CSGPolygonList& coplanarBack,
+                  CSGPolygonList& front,
+                  CSGPolygonList& back,
+                  Arena& arena,
+                  EdgeSplitCache& edgeSplits) {
+    auto classify = [this](CSGVertex* vert) {
+        // Distance from the plane to the vertex
+        float t = glm::dot(this->normal, vert->pos) - this->w;
+        return (t < -Threshold) ? Back : (t < Threshold) ? Coplanar : Front;
+    };
+    int numVerts = polygon.numVerts;
+    int polygonType = 0;
+    int numFrontVerts = 0;
+    int numBackVerts = 0;
+    int numSpanningEdges = 0;
+    int firstType = classify(polygon.verts[0]);
+    int type = firstType;
+    for (int i = 0; i < numVerts; i++) {
+        int nextType = i + 1 < numVerts ? classify(polygon.verts[i + 1]) : firstType;
         // Bitwise OR gives us number 3 (Spanning)
         // on numbers 1 and 2 or vice versa
         polygonType |= type;
-        vertTypes.push_back(type);
+        if(type != Back)
+            numFrontVerts++;
+        if(type != Front)
+            numBackVerts++;
+        if((type | nextType) == Spanning)
+            numSpanningEdges++;
+        type = nextType;
     }
     switch (polygonType) {
         case Coplanar:
@@ -1976,55 +2029,64 @@ void CSGPlane::splitPolygon(CSGPolygon& polygon,
             break;
         case Spanning:
         {
-            int numVerts = polygon.verts.size();
-            std::vector<CSGVertex*> toFront, toBack, toFrontNew, toBackNew;
-            toFrontNew.reserve(numVerts);
-            toFront.reserve(numVerts);
-            toBackNew.reserve(numVerts);
-            toBack.reserve(numVerts);
+            // Both halves are written straight into spans of their exact size
+            int numToFront = numFrontVerts + numSpanningEdges;
+            int numToBack = numBackVerts + numSpanningEdges;
+            CSGVertex** toFront = arena.makeArray<CSGVertex*>(numToFront);
+            CSGVertex** toBack = arena.makeArray<CSGVertex*>(numToBack);
+            int f = 0;
+            int b = 0;
+            int currentType = firstType;
             for (int i = 0; i < numVerts; i++) {
                 int j = (i + 1) % numVerts;
-                int currentType = vertTypes[i];
-                int nextType = vertTypes[j];
+                int nextType = j != 0 ? classify(polygon.verts[j]) : firstType;
                 CSGVertex* currentVert = polygon.verts[i];
                 CSGVertex* nextVert = polygon.verts[j];
                 if(currentType != Back)
-                    toFront.push_back(currentVert);
+                    toFront[f++] = currentVert;
                 if(currentType != Front) {
                     if(currentType != Back) {
-                        CSGVertex* v = new CSGVertex(*currentVert);
-                        v->isNew = true;
-                        toBack.push_back(v);
+                        // Back side gets a copy marked as new, cached
+                        // under the vertex alone so neighbours share it
+                        CSGVertex* v = edgeSplits.find(currentVert, nullptr, this);
+                        if(v == nullptr) {
+                            v = arena.make<CSGVertex>(*currentVert);
+                            v->isNew = true;
+                            edgeSplits.insert(currentVert, nullptr, this, v);
+                        }
+                        toBack[b++] = v;
                     } else
-                        toBack.push_back(currentVert);
+                        toBack[b++] = currentVert;
                 }
                 if((currentType | nextType) == Spanning) {
-                    float d1 = this->w - glm::dot(this->normal,
-                                                  currentVert->pos);
-                    float d2 = glm::dot(this->normal,
-                                        nextVert->pos - currentVert->pos);
-                    float t = d1 / d2;
-                    CSGVertex* v1 = currentVert->lerp(*nextVert, t);
-                    v1->isNew = true;
-                    toFrontNew.push_back(v1);
-                    toFront.push_back(v1);
-                    CSGVertex* v2 = new CSGVertex(*v1);
-                    toBackNew.push_back(v2);
-                    toBack.push_back(v2);
+                    // Both sides of the split and the polygon across the
+                    // edge all use the same vertex
+                    CSGVertex* v = edgeSplits.find(currentVert, nextVert, this);
+                    if(v == nullptr) {
+                        // Interpolating from the lesser endpoint gives the same
+                        // point whichever way round the edge is walked
+                        CSGVertex* from = currentVert;
+                        CSGVertex* to = nextVert;
+                        if(std::tie(to->pos.x, to->pos.y, to->pos.z) <
+                           std::tie(from->pos.x, from->pos.y, from->pos.z))
+                            std::swap(from, to);
+                        float d1 = this->w - glm::dot(this->normal, from->pos);
+                        float d2 = glm::dot(this->normal, to->pos - from->pos);
+                        float t = d1 / d2;
+                        v = from->lerp(*to, t, arena);
+                        v->isNew = true;
+                        edgeSplits.insert(currentVert, nextVert, this, v);
+                    }
+                    toFront[f++] = v;
+                    toBack[b++] = v;
                 }
+                currentType = nextType;
             }
-            if(toFront.size() >= 3)
-                front.push_back(CSGPolygon(toFront));
-            else {
-                for(auto* v : toFrontNew)
-                    delete v;
-            }
-            if(toBack.size() >= 3)
-                back.push_back(CSGPolygon(toBack));
-            else {
-                for(auto* v : toBackNew)
-                    delete v;
-            }
+            // Dropped vertices stay in the arena until the operation ends
+            if(numToFront >= 3)
+                front.push_back(CSGPolygon(toFront, numToFront));
+            if(numToBack >= 3)
+                back.push_back(CSGPolygon(toBack, numToBack));
         }
             break;
         default:
@@ -2032,8 +2094,8 @@ void CSGPlane::splitPolygon(CSGPolygon& polygon,
     }
 }
 
-CSGVertex* CSGVertex::lerp(CSGVertex& other, float t) {
-    CSGVertex *v = new CSGVertex();
+CSGVertex* CSGVertex::lerp(CSGVertex& other, float t, Arena& arena) {
+    CSGVertex *v = arena.make<CSGVertex>();
     v->pos = glm::mix(this->pos, other.pos, t);
     v->normal = glm::mix(this->normal, other.normal, t);
     return v;
@@ -2043,34 +2105,36 @@ void CSGVertex::flipNormal() {
     this->normal = -this->normal;
 }
 
-CSGPolygon::CSGPolygon(std::vector<CSGVertex*>& verts):
-    verts(verts), plane(verts[0]->pos, verts[1]->pos, verts[2]->pos) {}
+CSGPolygon::CSGPolygon(CSGVertex** verts, int numVerts):
+    plane(verts[0]->pos, verts[1]->pos, verts[2]->pos), verts(verts), numVerts(numVerts) {}
 
 void CSGPolygon::flip() {
-    std::reverse(this->verts.begin(), this->verts.end());
+    std::reverse(this->verts, this->verts + this->numVerts);
 }
 
-std::list<CSGPolygon> CSGPolygon::extractFromMesh(PolyMesh& mesh) {
-    std::list<CSGPolygon> polygons;
+CSGPolygonList CSGPolygon::extractFromMesh(PolyMesh& mesh, Arena& arena) {
+    CSGPolygonList polygons;
+    polygons.reserve(mesh.n_faces());
     std::unordered_map<int, CSGVertex*> vertices;
     for(auto vh : mesh.vertices()) {
-        CSGVertex* cv = new CSGVertex();
+        CSGVertex* cv = arena.make<CSGVertex>();
         cv->pos = vec3FromPoint(mesh.point(vh));
         cv->normal = vec3FromPoint(mesh.normal(vh));
         vertices[vh.idx()] = cv;
     }
     for(auto fh : mesh.faces()) {
-        std::vector<CSGVertex*> verts;
-        verts.reserve(fh.valence());
+        int numVerts = fh.valence();
+        CSGVertex** verts = arena.makeArray<CSGVertex*>(numVerts);
+        int i = 0;
         for(auto fvh : fh.vertices_ccw()) {
-            verts.push_back(vertices[fvh.idx()]);
+            verts[i++] = vertices[fvh.idx()];
         }
-        polygons.push_back(CSGPolygon(verts));
+        polygons.push_back(CSGPolygon(verts, numVerts));
     }
     return polygons;
 }
 
-PolyMesh CSGPolygon::toMesh(std::list<CSGPolygon> polygons) {
+PolyMesh CSGPolygon::toMesh(const CSGPolygonList& polygons) {
     PolyMesh mesh;
     mesh.request_face_status();
     mesh.request_edge_status();
@@ -2086,8 +2150,14 @@ PolyMesh CSGPolygon::toMesh(std::list<CSGPolygon> polygons) {
     std::list<CSGVertex*> verts;
     std::list<CSGVertex*> vertsToDelete;
     std::unordered_map<PolyMesh::VertexHandle, PolyMesh::VertexHandle> vertReplace;
-    for(auto poly : polygons) {
-        for(auto vert : poly.verts) {
+    // T-junction repair inserts vertices, so the output
+    // polygons get vertex lists of their own
+    std::vector<std::vector<CSGVertex*>> polygonVerts;
+    polygonVerts.reserve(polygons.size());
+    for(auto& poly : polygons)
+        polygonVerts.push_back(std::vector<CSGVertex*>(poly.verts, poly.verts + poly.numVerts));
+    for(auto& polyVerts : polygonVerts) {
+        for(auto vert : polyVerts) {
             if(vert->vh == PolyMesh::InvalidVertexHandle) {
                 vert->vh = mesh.add_vertex(vec3ToPoint(vert->pos));
                 mesh.set_normal(vert->vh, vec3ToPoint(vert->normal));
@@ -2097,53 +2167,114 @@ PolyMesh CSGPolygon::toMesh(std::list<CSGPolygon> polygons) {
         }
     }
     float threshold = 1e-5;
-    for(auto *v : verts) {
-        for(auto &poly : polygons) {
-            int numVerts = poly.verts.size();
-            for (int i = 0; i < numVerts; i++) {
-                int j = (i + 1) % numVerts;
-                CSGVertex* currentVert = poly.verts[i];
-                CSGVertex* nextVert = poly.verts[j];
-                if(glm::distance(v->pos, currentVert->pos) < threshold ||
-                   glm::distance(v->pos, nextVert->pos) < threshold)
+    // Each edge only tests the vertices hashed near it. Cells are about
+    // one average edge long, so an edge covers a handful of them
+    std::vector<CSGVertex*> hashedVerts(verts.begin(), verts.end());
+    std::vector<glm::vec3> hashedPoints;
+    hashedPoints.reserve(hashedVerts.size());
+    for(auto* v : hashedVerts)
+        hashedPoints.push_back(v->pos);
+    double totalEdgeLength = 0.0;
+    size_t numEdges = 0;
+    for(auto& polyVerts : polygonVerts) {
+        for(int i = 0; i < polyVerts.size(); i++) {
+            totalEdgeLength += glm::distance(polyVerts[i]->pos,
+                                             polyVerts[(i + 1) % polyVerts.size()]->pos);
+            numEdges++;
+        }
+    }
+    float cellSize = numEdges > 0 ? totalEdgeLength / numEdges : 1.0f;
+    SpatialHash hash(std::max(cellSize, threshold * 16));
+    hash.build(hashedPoints);
+    // A vertex is inserted into one edge of a polygon at most
+    std::vector<int> insertedInPolygon(hashedVerts.size(), -1);
+    std::vector<int> candidates;
+    std::vector<std::pair<int, float>> insertions;
+    std::vector<std::pair<float, int>> edgePoints;
+    std::vector<CSGVertex*> repaired;
+    for(int k = 0; k < polygonVerts.size(); k++) {
+        auto& polyVerts = polygonVerts[k];
+        int numVerts = polyVerts.size();
+        repaired.clear();
+        for (int i = 0; i < numVerts; i++) {
+            int j = (i + 1) % numVerts;
+            CSGVertex* currentVert = polyVerts[i];
+            CSGVertex* nextVert = polyVerts[j];
+            repaired.push_back(currentVert);
+            glm::vec3 start = currentVert->pos;
+            glm::vec3 end = nextVert->pos;
+            // isPointLyingOnSegment accepts points up to sqrt(threshold * length)
+            // away from the middle of the edge
+            float length = glm::distance(start, end);
+            float pad = std::sqrt(threshold * length) + threshold;
+            glm::vec3 extent(pad, pad, pad);
+            candidates.clear();
+            hash.query(glm::min(start, end) - extent, glm::max(start, end) + extent,
+                       candidates);
+            insertions.clear();
+            for(int c : candidates) {
+                if(insertedInPolygon[c] == k)
                     continue;
-                if(isPointLyingOnSegment(v->pos, currentVert->pos,
-                                         nextVert->pos, threshold)) {
-                    poly.verts.insert(poly.verts.begin() + i + 1, v);
-                    break;
-                }
+                glm::vec3 pos = hashedPoints[c];
+                if(glm::distance(pos, start) < threshold ||
+                   glm::distance(pos, end) < threshold)
+                    continue;
+                if(isPointLyingOnSegment(pos, start, end, threshold))
+                    insertions.push_back({ c, glm::dot(pos - start, end - start) });
             }
+            // Vertices go in the order they were added to the mesh and each
+            // one is tested against the piece of the edge it falls into,
+            // the same as inserting them into the polygon one by one
+            std::sort(insertions.begin(), insertions.end());
+            edgePoints.clear();
+            for(auto& insertion : insertions) {
+                int c = insertion.first;
+                glm::vec3 pos = hashedPoints[c];
+                auto it = std::lower_bound(edgePoints.begin(), edgePoints.end(),
+                                           std::make_pair(insertion.second, -1));
+                glm::vec3 pieceStart = it == edgePoints.begin() ? start : hashedPoints[(it - 1)->second];
+                glm::vec3 pieceEnd = it == edgePoints.end() ? end : hashedPoints[it->second];
+                if(glm::distance(pos, pieceStart) < threshold ||
+                   glm::distance(pos, pieceEnd) < threshold)
+                    continue;
+                if(!isPointLyingOnSegment(pos, pieceStart, pieceEnd, threshold))
+                    continue;
+                edgePoints.insert(it, { insertion.second, c });
+                insertedInPolygon[c] = k;
+            }
+            for(auto& point : edgePoints)
+                repaired.push_back(hashedVerts[point.second]);
         }
-    }
-    for(auto v1 : verts) {
-        if(!v1->isNew)
+        if(repaired.size() != numVerts)
+            polyVerts = repaired;
+    }
+    // New vertices absorb everything within threshold of them
+    std::vector<bool> isSeed;
+    isSeed.reserve(hashedVerts.size());
+    for(auto* v : hashedVerts)
+        isSeed.push_back(v->isNew);
+    std::vector<int> weld = weldPoints(hashedPoints, isSeed, threshold);
+    for(int i = 0; i < hashedVerts.size(); i++) {
+        if(weld[i] != i)
             continue;
-        if(vertReplace.find(v1->vh) != vertReplace.end())
+        CSGVertex* v = hashedVerts[i];
+        PolyMesh::VertexHandle newVert = mesh.add_vertex(vec3ToPoint(v->pos));
+        mesh.set_normal(newVert, vec3ToPoint(v->normal));
+        isNewProp[newVert] = true;
+        vertReplace[v->vh] = newVert;
+    }
+    for(int i = 0; i < hashedVerts.size(); i++) {
+        if(weld[i] == -1 || weld[i] == i)
             continue;
-        PolyMesh::VertexHandle newVert = PolyMesh::InvalidVertexHandle;
-        for(auto v2 : verts) {
-            if(v1 == v2)
-                continue;
-            if(vertReplace.find(v2->vh) != vertReplace.end())
-                continue;
-            if(glm::distance(v1->pos, v2->pos) < threshold) {
-                if(newVert == PolyMesh::InvalidVertexHandle) {
-                    newVert = mesh.add_vertex(vec3ToPoint(v1->pos));
-                    mesh.set_normal(newVert, vec3ToPoint(v1->normal));
-                    isNewProp[newVert] = true;
-                    vertReplace[v1->vh] = newVert;
-                }
-                vertReplace[v2->vh] = newVert;
-                vertsToDelete.push_back(v2);
-            }
-        }
+        vertReplace[hashedVerts[i]->vh] = vertReplace[hashedVerts[weld[i]]->vh];
+        vertsToDelete.push_back(hashedVerts[i]);
     }
     for(auto vert : vertsToDelete)
         mesh.delete_vertex(vert->vh);
-    for(auto poly : polygons) {
+    for(int k = 0; k < polygons.size(); k++) {
         std::vector<PolyMesh::VertexHandle> vhs;
-        vhs.reserve(poly.verts.size());
-        for(auto vert : poly.verts) {
+        vhs.reserve(polygonVerts[k].size());
+        for(auto vert : polygonVerts[k]) {
             PolyMesh::VertexHandle vh = vert->vh;
             if(vertReplace.find(vh) != vertReplace.end()) {
                 PolyMesh::VertexHandle rep = vertReplace[vh];
@@ -2152,133 +2283,400 @@ PolyMesh CSGPolygon::toMesh(std::list<CSGPolygon> polygons) {
             vhs.push_back(vh);
         }
         PolyMesh::FaceHandle fh = mesh.add_face(vhs);
-        mesh.set_normal(fh, vec3ToPoint(poly.plane.normal));
+        mesh.set_normal(fh, vec3ToPoint(polygons[k].plane.normal));
     }
     mesh.update_normals();
     return mesh;
 }
 
-BSPNode::BSPNode() {}
+void CSGContext::setStage(BooleanStage stage) {
+    if(progress != nullptr)
+        progress->stage = stage;
+}
 
-BSPNode::BSPNode(std::list<CSGPolygon>& polygons) {
+bool CSGContext::isCancelled() const {
+    return progress != nullptr && progress->isCancelled.load(std::memory_order_relaxed);
+}
+
+BSPNode::BSPNode(CSGContext& context):
+    context(&context) {
+    context.stats.numNodes++;
+}
+
+BSPNode::BSPNode(CSGPolygonList& polygons, CSGContext& context):
+    context(&context) {
+    context.stats.numNodes++;
     this->build(polygons);
 }
 
-std::list<CSGPolygon> BSPNode::allPolygons() {
-    std::list<CSGPolygon> polygons = this->polygons;
-    if(this->front != nullptr) {
-        std::list<CSGPolygon> frontPolygons = this->front->allPolygons();
-        polygons.insert(polygons.begin(), frontPolygons.begin(),
-                        frontPolygons.end());
-    }
-    if(this->back != nullptr) {
-        std::list<CSGPolygon> backPolygons = this->back->allPolygons();
-        polygons.insert(polygons.begin(), backPolygons.begin(),
-                        backPolygons.end());
-    }
+CSGPolygonList BSPNode::allPolygons() {
+    CSGPolygonList polygons;
+    this->collectPolygons(polygons);
     return polygons;
 }
 
-std::list<CSGPolygon> BSPNode::clipPolygons(std::list<CSGPolygon> &polygons) {
-    if (!this->plane)
-        return polygons;
-    std::list<CSGPolygon> toFront, toBack;
-    for (auto& poly : polygons) {
-        this->plane->splitPolygon(poly, toFront, toBack, toFront, toBack);
+void BSPNode::collectNodes(std::vector<BSPNode*>& out) {
+    std::vector<BSPNode*> stack;
+    stack.push_back(this);
+    while(!stack.empty()) {
+        BSPNode* node = stack.back();
+        stack.pop_back();
+        out.push_back(node);
+        if(node->back != nullptr)
+            stack.push_back(node->back);
+        if(node->front != nullptr)
+            stack.push_back(node->front);
     }
-    if(this->front != nullptr)
-        toFront = this->front->clipPolygons(toFront);
-    if(this->back != nullptr)
-        toBack = this->back->clipPolygons(toBack);
-    else
-        toBack = {};
-    std::list<CSGPolygon> combined;
-    combined.insert(combined.end(), toFront.begin(), toFront.end());
-    combined.insert(combined.end(), toBack.begin(), toBack.end());
-    return combined;
 }
 
-void BSPNode::clipTo(BSPNode* node) {
-    this->polygons = node->clipPolygons(this->polygons);
-    if(this->front != nullptr)
-        this->front->clipTo(node);
-    if(this->back != nullptr)
-        this->back->clipTo(node);
+void BSPNode::collectPolygons(CSGPolygonList& out) {
+    std::vector<BSPNode*> nodes;
+    this->collectNodes(nodes);
+    // Walking the pre-order backwards gives back subtree, front subtree,
+    // then the node itself, the same order the recursive version had
+    for(auto it = nodes.rbegin(); it != nodes.rend(); it++)
+        out.insert(out.end(), (*it)->polygons.begin(), (*it)->polygons.end());
 }
 
-void BSPNode::invert() {
-    for(auto& poly : this->polygons) {
-        poly.flip();
+// Storage of a clip running on another thread, handed back to the context
+// once the thread is joined. Splits made before the fork are looked up in
+// the cache it was forked from
+struct ClipScratch {
+    explicit ClipScratch(const EdgeSplitCache* forkedFrom):
+        edgeSplits(forkedFrom) {}
+    
+    Arena arena{ 16 * 1024 };
+    EdgeSplitCache edgeSplits;
+};
+
+CSGPolygonList BSPNode::clipPolygons(CSGPolygonList &polygons) {
+    CSGPolygonList result;
+    this->clipPolygons(polygons, result, this->context->arena,
+                       this->context->edgeSplits, 0);
+    return result;
+}
+
+void BSPNode::clipPolygons(const CSGPolygonList& polygons, CSGPolygonList& out,
+                           Arena& arena, EdgeSplitCache& edgeSplits,
+                           int forkDepth) {
+    ThreadPool* pool = this->context->pool;
+    const BSPClipOptions& options = this->context->clipOptions;
+    if(pool != nullptr && this->plane != nullptr &&
+       this->front != nullptr && this->back != nullptr &&
+       forkDepth < options.maxForkDepth &&
+       polygons.size() >= options.minPolygonsToFork) {
+        CSGPolygonList toFront, toBack;
+        for (auto& poly : polygons) {
+            this->plane->splitPolygon(poly, toFront, toBack, toFront, toBack,
+                                      arena, edgeSplits);
+        }
+        // The back subtree goes to the pool with storage of its own
+        // while this thread takes the front. Front results come first,
+        // so polygons come out in the order of a serial clip. Both sides
+        // split into caches of their own over edgeSplits, which stays
+        // unchanged until they are joined
+        CSGPolygonList backOut;
+        ClipScratch backScratch(&edgeSplits);
+        EdgeSplitCache frontSplits(&edgeSplits);
+        TaskGroup group(*pool);
+        group.run([&] {
+            this->back->clipPolygons(toBack, backOut, backScratch.arena,
+                                     backScratch.edgeSplits, forkDepth + 1);
+        });
+        this->front->clipPolygons(toFront, out, arena, frontSplits, forkDepth + 1);
+        group.wait();
+        arena.adopt(backScratch.arena);
+        edgeSplits.merge(frontSplits);
+        edgeSplits.merge(backScratch.edgeSplits);
+        out.insert(out.end(), backOut.begin(), backOut.end());
+        return;
+    }
+    struct ClipTask {
+        BSPNode* node;
+        CSGPolygonList polygons;
+    };
+    std::vector<ClipTask> stack;
+    stack.push_back({ this, polygons });
+    while(!stack.empty()) {
+        if(this->context->isCancelled())
+            return;
+        ClipTask task = std::move(stack.back());
+        stack.pop_back();
+        BSPNode* node = task.node;
+        if(!node->plane) {
+            out.insert(out.end(), task.polygons.begin(), task.polygons.end());
+            continue;
+        }
+        CSGPolygonList toFront, toBack;
+        for (auto& poly : task.polygons) {
+            node->plane->splitPolygon(poly, toFront, toBack, toFront, toBack,
+                                      arena, edgeSplits);
+        }
+        // Back is pushed first so the front subtree is finished before it
+        // and the output keeps the order of the recursive version.
+        // Without a back child the back polygons are dropped
+        if(node->back != nullptr && !toBack.empty())
+            stack.push_back({ node->back, std::move(toBack) });
+        if(node->front == nullptr)
+            out.insert(out.end(), toFront.begin(), toFront.end());
+        else if(!toFront.empty())
+            stack.push_back({ node->front, std::move(toFront) });
     }
-    this->plane->flip();
-    if(this->front != nullptr)
-        this->front->invert();
-    if(this->back != nullptr)
-        this->back->invert();
-    BSPNode* front = this->front;
-    this->front = this->back;
-    this->back = front;
 }
 
-void BSPNode::build(std::list<CSGPolygon>& polygons) {
-    if(polygons.empty())
+void BSPNode::clipTo(BSPNode* node) {
+    std::vector<BSPNode*> nodes;
+    this->collectNodes(nodes);
+    ThreadPool* pool = this->context->pool;
+    size_t minPolygonsToFork = this->context->clipOptions.minPolygonsToFork;
+    size_t numPolygons = 0;
+    for(auto* n : nodes)
+        numPolygons += n->polygons.size();
+    if(pool == nullptr || numPolygons < minPolygonsToFork) {
+        for(auto* n : nodes) {
+            if(this->context->isCancelled())
+                return;
+            n->polygons = node->clipPolygons(n->polygons);
+        }
         return;
-    if(this->plane == nullptr)
-        this->plane = new CSGPlane(polygons.front().plane);
-    std::list<CSGPolygon> toFront, toBack;
-    for (auto& poly : polygons) {
-        this->plane->splitPolygon(poly, this->polygons, this->polygons,
-                                  toFront, toBack);
     }
-    if(!toFront.empty()) {
-        if(this->front == nullptr)
-            this->front = new BSPNode();
-        this->front->build(toFront);
+    // Nodes are clipped independently, so they are handed out in runs
+    // of a few pool-sized shares each, every run with its own storage.
+    // The context cache is only read until the runs are joined
+    size_t runSize = std::max<size_t>(numPolygons / (4 * (pool->size() + 1)),
+                                      minPolygonsToFork / 4 + 1);
+    std::vector<std::unique_ptr<ClipScratch>> scratches;
+    {
+        TaskGroup group(*pool);
+        size_t begin = 0;
+        while(begin < nodes.size()) {
+            size_t end = begin;
+            size_t runPolygons = 0;
+            while(end < nodes.size() && runPolygons < runSize)
+                runPolygons += nodes[end++]->polygons.size();
+            scratches.push_back(std::unique_ptr<ClipScratch>(
+                new ClipScratch(&this->context->edgeSplits)));
+            ClipScratch* scratch = scratches.back().get();
+            group.run([&nodes, node, scratch, begin, end] {
+                for(size_t i = begin; i < end; i++) {
+                    if(node->context->isCancelled())
+                        return;
+                    CSGPolygonList clipped;
+                    node->clipPolygons(nodes[i]->polygons, clipped, scratch->arena,
+                                       scratch->edgeSplits, 0);
+                    nodes[i]->polygons = std::move(clipped);
+                }
+            });
+            begin = end;
+        }
+        group.wait();
     }
-    if(!toBack.empty()) {
-        if(this->back == nullptr)
-            this->back = new BSPNode();
-        this->back->build(toBack);
+    for(auto& scratch : scratches) {
+        this->context->arena.adopt(scratch->arena);
+        this->context->edgeSplits.merge(scratch->edgeSplits);
     }
 }
 
-BSPNode* BSPNode::fromMesh(PolyMesh& mesh) {
-    std::list<CSGPolygon> polygons = CSGPolygon::extractFromMesh(mesh);
-    return new BSPNode(polygons);
+void BSPNode::invert() {
+    std::vector<BSPNode*> nodes;
+    this->collectNodes(nodes);
+    for(auto* n : nodes) {
+        for(auto& poly : n->polygons) {
+            poly.flip();
+        }
+        if(n->plane != nullptr)
+            n->plane->flip();
+        BSPNode* front = n->front;
+        n->front = n->back;
+        n->back = front;
+    }
+}
+
+// Samples candidate planes evenly across the list and scores each one
+// against an evenly spaced subset of the polygons.
+// Returns the index of the polygon whose plane should split the list
+int selectSplittingPolygon(const CSGPolygonList& polygons,
+                           const BSPBuildOptions& options) {
+    int numPolygons = polygons.size();
+    if(options.splitterMode == BSPSplitterMode::First ||
+       numPolygons < options.minPolygonsToSample ||
+       options.numCandidates < 2)
+        return 0;
+    int numCandidates = std::min(options.numCandidates, numPolygons);
+    int numScored = std::min(options.numScoredPolygons, numPolygons);
+    int bestIndex = 0;
+    float bestScore = std::numeric_limits<float>::max();
+    for(int c = 0; c < numCandidates; c++) {
+        int index = (size_t)c * numPolygons / numCandidates;
+        const CSGPlane& candidate = polygons[index].plane;
+        // Slivers give planes with a broken normal, never pick them
+        if(!(std::abs(glm::length(candidate.normal) - 1.0f) < 1e-3f))
+            continue;
+        int numSplits = 0;
+        int numFront = 0;
+        int numBack = 0;
+        for(int i = 0; i < numScored; i++) {
+            const CSGPolygon& poly = polygons[(size_t)i * numPolygons / numScored];
+            switch(candidate.classifyPolygon(poly)) {
+                case CSGPlane::Front:
+                    numFront++;
+                    break;
+                case CSGPlane::Back:
+                    numBack++;
+                    break;
+                case CSGPlane::Spanning:
+                    numSplits++;
+                    break;
+                default:
+                    break;
+            }
+        }
+        float score = options.splitWeight * numSplits +
+            options.balanceWeight * std::abs(numFront - numBack);
+        if(score < bestScore) {
+            bestScore = score;
+            bestIndex = index;
+        }
+    }
+    return bestIndex;
 }
 
-void countReferencesInBSPNode(BSPNode* node) {
-    if(node == nullptr)
+void BSPNode::build(CSGPolygonList& polygons) {
+    if(polygons.empty())
         return;
-    for(auto poly : node->polygons) {
-        for(auto *vert : poly.verts)
-            vert->deleteInfo.numUsers++;
+    struct BuildTask {
+        BSPNode* node;
+        CSGPolygonList polygons;
+    };
+    Arena& arena = context->arena;
+    BSPStats& stats = context->stats;
+    std::vector<BuildTask> stack;
+    stack.push_back({ this, polygons });
+    while(!stack.empty()) {
+        if(context->isCancelled())
+            return;
+        BuildTask task = std::move(stack.back());
+        stack.pop_back();
+        BSPNode* node = task.node;
+        CSGPolygonList& list = task.polygons;
+        stats.maxDepth = std::max(stats.maxDepth, node->depth);
+        int splitter = -1;
+        if(node->plane == nullptr) {
+            splitter = selectSplittingPolygon(list, context->buildOptions);
+            node->plane = arena.make<CSGPlane>(list[splitter].plane);
+        }
+        CSGPolygonList toFront, toBack;
+        for (int i = 0; i < list.size(); i++) {
+            // The splitter always stays here, even if rounding would
+            // classify it otherwise, so every level makes progress
+            if(i == splitter) {
+                node->polygons.push_back(list[i]);
+                continue;
+            }
+            node->plane->splitPolygon(list[i], node->polygons, node->polygons,
+                                      toFront, toBack, arena, context->edgeSplits);
+        }
+        if(!toFront.empty()) {
+            if(node->front == nullptr) {
+                node->front = arena.make<BSPNode>(*context);
+                node->front->depth = node->depth + 1;
+            }
+            stack.push_back({ node->front, std::move(toFront) });
+        }
+        if(!toBack.empty()) {
+            if(node->back == nullptr) {
+                node->back = arena.make<BSPNode>(*context);
+                node->back->depth = node->depth + 1;
+            }
+            stack.push_back({ node->back, std::move(toBack) });
+        }
     }
-    countReferencesInBSPNode(node->front);
-    countReferencesInBSPNode(node->back);
 }
 
-void deleteRecursivelyBSPNode(BSPNode* node) {
-    if(node == nullptr)
-        return;
-    delete node->plane;
-    for(auto poly : node->polygons) {
-        for(auto *vert : poly.verts) {
-            vert->deleteInfo.numUsers--;
-            if(vert->deleteInfo.numUsers == 0)
-                delete vert;
+BSPNode* BSPNode::fromMesh(PolyMesh& mesh, CSGContext& context) {
+    CSGPolygonList polygons = CSGPolygon::extractFromMesh(mesh, context.arena);
+    return context.arena.make<BSPNode>(polygons, context);
+}
+
+// Bounding box of the polygons, an empty list gives an inverted box
+static void polygonBounds(const CSGPolygonList& polygons, glm::vec3& min, glm::vec3& max) {
+    min = glm::vec3(std::numeric_limits<float>::max());
+    max = -min;
+    for(auto& poly : polygons) {
+        for(int i = 0; i < poly.numVerts; i++) {
+            min = glm::min(min, poly.verts[i]->pos);
+            max = glm::max(max, poly.verts[i]->pos);
         }
     }
-    deleteRecursivelyBSPNode(node->front);
-    deleteRecursivelyBSPNode(node->back);
-    delete node;
 }
 
-void BSPNode::deepDelete(std::list<BSPNode*> roots) {
-    for (BSPNode* root : roots)
-        countReferencesInBSPNode(root);
-    for (BSPNode* root : roots)
-        deleteRecursivelyBSPNode(root);
+// Pieces of the polygons in the box go to inside, the rest to outside
+static void splitPolygonsByBox(const CSGPolygonList& polygons, glm::vec3 min, glm::vec3 max,
+                               CSGPolygonList& inside, CSGPolygonList& outside,
+                               CSGContext& context) {
+    // Normals point out of the box, so front is outside
+    CSGPlane* planes[6] = {
+        context.arena.make<CSGPlane>(glm::vec3(-1.0f, 0.0f, 0.0f), -min.x),
+        context.arena.make<CSGPlane>(glm::vec3(1.0f, 0.0f, 0.0f), max.x),
+        context.arena.make<CSGPlane>(glm::vec3(0.0f, -1.0f, 0.0f), -min.y),
+        context.arena.make<CSGPlane>(glm::vec3(0.0f, 1.0f, 0.0f), max.y),
+        context.arena.make<CSGPlane>(glm::vec3(0.0f, 0.0f, -1.0f), -min.z),
+        context.arena.make<CSGPlane>(glm::vec3(0.0f, 0.0f, 1.0f), max.z)
+    };
+    CSGPolygonList pieces, next;
+    for(auto& poly : polygons) {
+        glm::vec3 polyMin = poly.verts[0]->pos;
+        glm::vec3 polyMax = polyMin;
+        for(int i = 1; i < poly.numVerts; i++) {
+            polyMin = glm::min(polyMin, poly.verts[i]->pos);
+            polyMax = glm::max(polyMax, poly.verts[i]->pos);
+        }
+        if(glm::any(glm::lessThan(polyMax, min)) || glm::any(glm::greaterThan(polyMin, max))) {
+            outside.push_back(poly);
+            continue;
+        }
+        if(glm::all(glm::greaterThanEqual(polyMin, min)) &&
+           glm::all(glm::lessThanEqual(polyMax, max))) {
+            inside.push_back(poly);
+            continue;
+        }
+        pieces.clear();
+        pieces.push_back(poly);
+        for(auto* plane : planes) {
+            next.clear();
+            for(auto& piece : pieces)
+                plane->splitPolygon(piece, next, next, outside, next,
+                                    context.arena, context.edgeSplits);
+            pieces.swap(next);
+        }
+        inside.insert(inside.end(), pieces.begin(), pieces.end());
+    }
+}
+
+CSGOverlap CSGOverlap::fromPolygons(const CSGPolygonList& a, const CSGPolygonList& b,
+                                    CSGContext& context) {
+    CSGOverlap overlap;
+    glm::vec3 minA, maxA, minB, maxB;
+    polygonBounds(a, minA, maxA);
+    polygonBounds(b, minB, maxB);
+    // Padding keeps faces lying on the box out of its planes
+    glm::vec3 pad(CSGPlane::Threshold * 16);
+    glm::vec3 min = glm::max(minA, minB) - pad;
+    glm::vec3 max = glm::min(maxA, maxB) + pad;
+    if(glm::any(glm::greaterThan(min, max))) {
+        overlap.outsideA = a;
+        overlap.outsideB = b;
+        return overlap;
+    }
+    splitPolygonsByBox(a, min, max, overlap.insideA, overlap.outsideA, context);
+    splitPolygonsByBox(b, min, max, overlap.insideB, overlap.outsideB, context);
+    if(overlap.insideA.empty() || overlap.insideB.empty()) {
+        overlap.insideA = a;
+        overlap.insideB = b;
+        overlap.outsideA.clear();
+        overlap.outsideB.clear();
+    }
+    return overlap;
 }
 
 void unionBSP(BSPNode* a, BSPNode* b) {
@@ -2314,68 +2712,699 @@ void intersectBSP(BSPNode* a, BSPNode* b) {
     a->invert();
 }
 
+CSGPolygonList booleanPolygons(const CSGPolygonList& a, const CSGPolygonList& b,
+                               BooleanOperation operation, CSGContext& context) {
+    context.setStage(BooleanStage::Cull);
+    CSGOverlap overlap = CSGOverlap::fromPolygons(a, b, context);
+    // Outside the overlap each operand is outside the other one. Union
+    // keeps both, subtraction keeps a and intersection keeps neither
+    CSGPolygonList result;
+    if(operation != BooleanOperation::Intersect)
+        result = std::move(overlap.outsideA);
+    if(operation == BooleanOperation::Union)
+        result.insert(result.end(), overlap.outsideB.begin(), overlap.outsideB.end());
+    // The overlap has polygons of both operands or of neither
+    if(overlap.insideA.empty() || overlap.insideB.empty())
+        return result;
+    context.setStage(BooleanStage::Build);
+    BSPNode* bspA = context.arena.make<BSPNode>(overlap.insideA, context);
+    BSPNode* bspB = context.arena.make<BSPNode>(overlap.insideB, context);
+    context.setStage(BooleanStage::Clip);
+    switch(operation) {
+        case BooleanOperation::Union:
+            unionBSP(bspA, bspB);
+            break;
+        case BooleanOperation::Subtract:
+            subtractBSP(bspA, bspB);
+            break;
+        case BooleanOperation::Intersect:
+            intersectBSP(bspA, bspB);
+            break;
+    }
+    bspA->collectPolygons(result);
+    return result;
+}
+
+CSGPolygonList unionAllPolygons(std::vector<CSGPolygonList> lists, CSGContext& context) {
+    if(lists.empty())
+        return CSGPolygonList();
+    while(lists.size() > 1) {
+        size_t numPairs = lists.size() / 2;
+        std::vector<CSGPolygonList> merged(numPairs + lists.size() % 2);
+        if(context.pool == nullptr) {
+            for(size_t i = 0; i < numPairs; i++)
+                merged[i] = booleanPolygons(lists[2 * i], lists[2 * i + 1],
+                                            BooleanOperation::Union, context);
+        } else {
+            // Every pair gets a context of its own, the arenas are
+            // handed back once the level is joined
+            std::vector<std::unique_ptr<CSGContext>> pairContexts;
+            {
+                TaskGroup group(*context.pool);
+                for(size_t i = 0; i < numPairs; i++) {
+                    pairContexts.push_back(std::unique_ptr<CSGContext>(new CSGContext()));
+                    CSGContext* pairContext = pairContexts.back().get();
+                    pairContext->buildOptions = context.buildOptions;
+                    pairContext->clipOptions = context.clipOptions;
+                    pairContext->pool = context.pool;
+                    pairContext->progress = context.progress;
+                    group.run([&lists, &merged, pairContext, i] {
+                        merged[i] = booleanPolygons(lists[2 * i], lists[2 * i + 1],
+                                                    BooleanOperation::Union, *pairContext);
+                    });
+                }
+                group.wait();
+            }
+            for(auto& pairContext : pairContexts)
+                context.arena.adopt(pairContext->arena);
+        }
+        if(lists.size() % 2 == 1)
+            merged.back() = std::move(lists.back());
+        lists.swap(merged);
+        if(context.isCancelled())
+            return CSGPolygonList();
+    }
+    return std::move(lists.front());
+}
+
+// Cancelled operations give an empty mesh
+static PolyMesh booleanMeshes(PolyMesh& a, PolyMesh& b, BooleanOperation operation,
+                              BooleanProgress* progress = nullptr) {
+    // Everything allocated by the operation is freed with the context
+    CSGContext context;
+    context.pool = &ThreadPool::shared();
+    context.progress = progress;
+    context.setStage(BooleanStage::Extract);
+    CSGPolygonList polygonsA = CSGPolygon::extractFromMesh(a, context.arena);
+    CSGPolygonList polygonsB = CSGPolygon::extractFromMesh(b, context.arena);
+    CSGPolygonList polygons = booleanPolygons(polygonsA, polygonsB, operation, context);
+    if(context.isCancelled())
+        return PolyMesh();
+    context.setStage(BooleanStage::ToMesh);
+    PolyMesh mesh = CSGPolygon::toMesh(polygons);
+    if(context.isCancelled())
+        return PolyMesh();
+    context.setStage(BooleanStage::PostProcess);
+    postProcessBooleanMesh(mesh);
+    return mesh;
+}
+
+PolyMesh unionMeshes(PolyMesh& a, PolyMesh& b) {
+    return booleanMeshes(a, b, BooleanOperation::Union);
+}
+
 PolyMesh subtractMeshes(PolyMesh& a, PolyMesh& b) {
-    BSPNode* bspA = BSPNode::fromMesh(a);
-    BSPNode* bspB = BSPNode::fromMesh(b);
-    subtractBSP(bspA, bspB);
-    PolyMesh mesh = CSGPolygon::toMesh(bspA->allPolygons());
+    return booleanMeshes(a, b, BooleanOperation::Subtract);
+}
+
+PolyMesh intersectMeshes(PolyMesh& a, PolyMesh& b) {
+    return booleanMeshes(a, b, BooleanOperation::Intersect);
+}
+
+PolyMesh subtractMeshes(PolyMesh& a, std::vector<PolyMesh>& cutters) {
+    CSGContext context;
+    context.pool = &ThreadPool::shared();
+    CSGPolygonList polygonsA = CSGPolygon::extractFromMesh(a, context.arena);
+    std::vector<CSGPolygonList> cutterPolygons;
+    cutterPolygons.reserve(cutters.size());
+    for(auto& cutter : cutters)
+        cutterPolygons.push_back(CSGPolygon::extractFromMesh(cutter, context.arena));
+    CSGPolygonList cutter = unionAllPolygons(std::move(cutterPolygons), context);
+    PolyMesh mesh = CSGPolygon::toMesh(booleanPolygons(polygonsA, cutter,
+                                                       BooleanOperation::Subtract, context));
     postProcessBooleanMesh(mesh);
-    BSPNode::deepDelete({bspA, bspB});
     return mesh;
 }
 
-void postProcessBooleanMesh(PolyMesh& mesh) {
-    return;
-    const float threshold = 1e-5;
-    auto isNewProp = OpenMesh::getOrMakeProperty<PolyMesh::VertexHandle, bool>
-        (mesh, "is_new");
-    // Split edges
+BooleanJob::BooleanJob(const PolyMesh& a, const PolyMesh& b, BooleanOperation operation):
+    a(a), b(b), operation(operation) {
+    thread = std::thread([this] {
+        PolyMesh mesh = booleanMeshes(this->a, this->b, this->operation, &progress);
+        if(progress.isCancelled) {
+            progress.stage = BooleanStage::Cancelled;
+            return;
+        }
+        // Published by the stage, readers see the result once they see Finished
+        result = std::move(mesh);
+        progress.stage = BooleanStage::Finished;
+    });
+}
+
+BooleanJob::~BooleanJob() {
+    cancel();
+    if(thread.joinable())
+        thread.join();
+}
+
+BooleanStage BooleanJob::getStage() const {
+    return progress.stage;
+}
+
+bool BooleanJob::isFinished() const {
+    return getStage() == BooleanStage::Finished;
+}
+
+bool BooleanJob::isDone() const {
+    BooleanStage stage = getStage();
+    return stage == BooleanStage::Finished || stage == BooleanStage::Cancelled;
+}
+
+void BooleanJob::cancel() {
+    progress.isCancelled = true;
+}
+
+PolyMesh BooleanJob::takeResult() {
+    if(!isFinished())
+        return PolyMesh();
+    return std::move(result);
+}
+
+void BooleanOperand::setMesh(PolyMesh& mesh, uint64_t version) {
+    if(hasMesh && this->version == version)
+        return;
+    local.arena.release();
+    local.edgeSplits = EdgeSplitCache();
+    local.stats = BSPStats();
+    root = BSPNode::fromMesh(mesh, local);
+    this->version = version;
+    hasMesh = true;
+}
+
+void BooleanOperand::setTransform(const glm::mat4& transform) {
+    this->transform = transform;
+}
+
+const glm::mat4& BooleanOperand::getTransform() const {
+    return transform;
+}
+
+bool BooleanOperand::isEmpty() const {
+    return root == nullptr || root->plane == nullptr;
+}
+
+BSPNode* BooleanOperand::instantiate(CSGContext& context) const {
+    BSPNode* copy = context.arena.make<BSPNode>(context);
+    if(isEmpty())
+        return copy;
+    // Affine maps keep planes planar, so points go through the transform
+    // and plane normals through its inverse transpose
+    glm::mat3 normalTransform = glm::transpose(glm::inverse(glm::mat3(transform)));
+    auto transformPlane = [&](const CSGPlane& plane) {
+        glm::vec3 normal = glm::normalize(normalTransform * plane.normal);
+        glm::vec3 point = glm::vec3(transform * glm::vec4(plane.normal * plane.w, 1.0f));
+        return CSGPlane(normal, glm::dot(normal, point));
+    };
+    std::unordered_map<const CSGVertex*, CSGVertex*> vertices;
+    auto copyVertex = [&](const CSGVertex* vert) {
+        CSGVertex*& v = vertices[vert];
+        if(v == nullptr) {
+            v = context.arena.make<CSGVertex>();
+            v->pos = glm::vec3(transform * glm::vec4(vert->pos, 1.0f));
+            v->normal = glm::normalize(normalTransform * vert->normal);
+            v->isNew = vert->isNew;
+        }
+        return v;
+    };
+    // Operations flip and split polygons in place, so every
+    // polygon gets a span of its own in the copy
+    std::vector<std::pair<const BSPNode*, BSPNode*>> stack;
+    stack.push_back({ root, copy });
+    while(!stack.empty()) {
+        const BSPNode* node = stack.back().first;
+        BSPNode* nodeCopy = stack.back().second;
+        stack.pop_back();
+        nodeCopy->depth = node->depth;
+        if(node->plane != nullptr)
+            nodeCopy->plane = context.arena.make<CSGPlane>(transformPlane(*node->plane));
+        nodeCopy->polygons.reserve(node->polygons.size());
+        for(auto& poly : node->polygons) {
+            CSGPolygon polyCopy = poly;
+            polyCopy.verts = context.arena.makeArray<CSGVertex*>(poly.numVerts);
+            for(int i = 0; i < poly.numVerts; i++)
+                polyCopy.verts[i] = copyVertex(poly.verts[i]);
+            polyCopy.plane = transformPlane(poly.plane);
+            nodeCopy->polygons.push_back(polyCopy);
+        }
+        if(node->front != nullptr) {
+            nodeCopy->front = context.arena.make<BSPNode>(context);
+            stack.push_back({ node->front, nodeCopy->front });
+        }
+        if(node->back != nullptr) {
+            nodeCopy->back = context.arena.make<BSPNode>(context);
+            stack.push_back({ node->back, nodeCopy->back });
+        }
+    }
+    return copy;
+}
+
+PolyMesh booleanOperands(const BooleanOperand& a, const BooleanOperand& b,
+                         BooleanOperation operation) {
+    CSGContext context;
+    context.pool = &ThreadPool::shared();
+    BSPNode* bspA = a.instantiate(context);
+    BSPNode* bspB = b.instantiate(context);
+    CSGPolygonList result;
+    // Trees of empty operands keep everything they clip,
+    // so those cases are answered directly
+    if(a.isEmpty() || b.isEmpty()) {
+        if(operation != BooleanOperation::Intersect)
+            bspA->collectPolygons(result);
+        if(operation == BooleanOperation::Union)
+            bspB->collectPolygons(result);
+    } else {
+        switch(operation) {
+            case BooleanOperation::Union:
+                unionBSP(bspA, bspB);
+                break;
+            case BooleanOperation::Subtract:
+                subtractBSP(bspA, bspB);
+                break;
+            case BooleanOperation::Intersect:
+                intersectBSP(bspA, bspB);
+                break;
+        }
+        bspA->collectPolygons(result);
+    }
+    PolyMesh mesh = CSGPolygon::toMesh(result);
+    postProcessBooleanMesh(mesh);
+    return mesh;
+}
+
+PolyMesh subtractMeshes(const BooleanOperand& a, const BooleanOperand& b) {
+    return booleanOperands(a, b, BooleanOperation::Subtract);
+}
+
+// Deletes oldFaces and adds newFaces. add_face refuses faces that would
+// make an edge complex or a vertex non-manifold, the old faces are put
+// back then and false is returned. Vertices are left alone either way
+static bool replaceFaces(PolyMesh& mesh, const std::vector<PolyMesh::FaceHandle>& oldFaces,
+                         const std::vector<std::vector<PolyMesh::VertexHandle>>& newFaces) {
+    std::vector<std::vector<PolyMesh::VertexHandle>> oldVerts;
+    oldVerts.reserve(oldFaces.size());
+    for(auto fh : oldFaces) {
+        std::vector<PolyMesh::VertexHandle> faceVerts;
+        for(auto fvh : mesh.fv_ccw_range(fh))
+            faceVerts.push_back(fvh);
+        oldVerts.push_back(std::move(faceVerts));
+        mesh.delete_face(fh, false);
+    }
+    std::vector<PolyMesh::FaceHandle> added;
+    added.reserve(newFaces.size());
+    for(auto& faceVerts : newFaces) {
+        PolyMesh::FaceHandle fh = mesh.add_face(faceVerts);
+        if(fh.is_valid()) {
+            added.push_back(fh);
+            continue;
+        }
+        for(auto addedFh : added)
+            mesh.delete_face(addedFh, false);
+        for(auto& verts : oldVerts)
+            mesh.add_face(verts);
+        return false;
+    }
+    return true;
+}
+
+void weldVertices(PolyMesh& mesh, float threshold) {
+    std::vector<PolyMesh::VertexHandle> vhs;
+    std::vector<glm::vec3> points;
     for(auto vh : mesh.vertices()) {
-        if(!isNewProp[vh] || vh.deleted())
+        if(vh.deleted())
             continue;
-        glm::vec3 point = vec3FromPoint(mesh.point(vh));
+        vhs.push_back(vh);
+        points.push_back(vec3FromPoint(mesh.point(vh)));
+    }
+    std::vector<int> weld = weldPoints(points, std::vector<bool>(points.size(), true),
+                                       threshold);
+    std::unordered_map<PolyMesh::VertexHandle, PolyMesh::VertexHandle> vertReplace;
+    for(int i = 0; i < vhs.size(); i++) {
+        if(weld[i] != -1 && weld[i] != i)
+            vertReplace[vhs[i]] = vhs[weld[i]];
+    }
+    if(vertReplace.empty())
+        return;
+    // Faces around welded vertices are rebuilt on the surviving ones,
+    // edges that collapse to a point are dropped
+    std::vector<PolyMesh::FaceHandle> oldFaces;
+    std::vector<std::vector<PolyMesh::VertexHandle>> newFaces;
+    for(auto fh : mesh.faces()) {
+        if(fh.deleted())
+            continue;
+        std::vector<PolyMesh::VertexHandle> faceVerts;
+        bool isWelded = false;
+        for(auto fvh : fh.vertices_ccw()) {
+            PolyMesh::VertexHandle vh = fvh;
+            auto it = vertReplace.find(vh);
+            if(it != vertReplace.end()) {
+                vh = it->second;
+                isWelded = true;
+            }
+            if(faceVerts.empty() || faceVerts.back() != vh)
+                faceVerts.push_back(vh);
+        }
+        if(!isWelded)
+            continue;
+        if(faceVerts.size() > 1 && faceVerts.front() == faceVerts.back())
+            faceVerts.pop_back();
+        oldFaces.push_back(fh);
+        if(faceVerts.size() >= 3)
+            newFaces.push_back(faceVerts);
+    }
+    // A weld that would leave the surface non-manifold is not done at all
+    if(!replaceFaces(mesh, oldFaces, newFaces))
+        return;
+    for(auto& replacement : vertReplace)
+        mesh.delete_vertex(replacement.first, false);
+}
+
+// True when the corner between two boundary directions turns the way normal
+// points or goes straight on, within sineTolerance. Going back along the
+// same line is not convex
+static bool isConvexCorner(glm::vec3 in, glm::vec3 out, glm::vec3 normal, float sineTolerance) {
+    float lengths = glm::length(in) * glm::length(out);
+    if(lengths <= 0.0f)
+        return true;
+    float sine = glm::dot(glm::cross(in, out), normal);
+    float cosine = glm::dot(in, out);
+    if(sine < -sineTolerance * lengths)
+        return false;
+    return cosine >= 0.0f || sine >= sineTolerance * lengths;
+}
+
+static bool isStraightCorner(glm::vec3 in, glm::vec3 out, float sineTolerance) {
+    float lengths = glm::length(in) * glm::length(out);
+    return lengths <= 0.0f || (glm::dot(in, out) > 0.0f &&
+                               glm::length(glm::cross(in, out)) <= sineTolerance * lengths);
+}
+
+// Union-find over faces with the boundary of every set walked through the
+// mesh. A set is the faces whose root is the same
+struct FaceSets {
+    const PolyMesh& mesh;
+    std::vector<int> parents;
+
+    explicit FaceSets(const PolyMesh& mesh): mesh(mesh), parents(mesh.n_faces()) {
+        for(int i = 0; i < parents.size(); i++)
+            parents[i] = i;
+    }
+
+    int find(int face) {
+        while(parents[face] != face) {
+            parents[face] = parents[parents[face]];
+            face = parents[face];
+        }
+        return face;
+    }
+
+    // Root of the face across heh, -1 on the mesh boundary
+    int across(PolyMesh::HalfedgeHandle heh) {
+        PolyMesh::FaceHandle fh = mesh.opposite_face_handle(heh);
+        return fh.is_valid() ? find(fh.idx()) : -1;
+    }
+
+    // Boundary halfedges of the set of heh before and after it, turning
+    // around the vertex past the halfedges inside the set
+    PolyMesh::HalfedgeHandle nextOnBoundary(PolyMesh::HalfedgeHandle heh, int root) {
+        PolyMesh::HalfedgeHandle first = mesh.next_halfedge_handle(heh);
+        PolyMesh::HalfedgeHandle next = first;
+        while(across(next) == root) {
+            next = mesh.next_halfedge_handle(mesh.opposite_halfedge_handle(next));
+            if(next == first)
+                break;
+        }
+        return next;
+    }
+
+    PolyMesh::HalfedgeHandle prevOnBoundary(PolyMesh::HalfedgeHandle heh, int root) {
+        PolyMesh::HalfedgeHandle first = mesh.prev_halfedge_handle(heh);
+        PolyMesh::HalfedgeHandle prev = first;
+        while(across(prev) == root) {
+            prev = mesh.prev_halfedge_handle(mesh.opposite_halfedge_handle(prev));
+            if(prev == first)
+                break;
+        }
+        return prev;
+    }
+};
+
+static glm::vec3 halfedgeVector(const PolyMesh& mesh, PolyMesh::HalfedgeHandle heh) {
+    return vec3FromPoint(mesh.point(mesh.to_vertex_handle(heh))) -
+        vec3FromPoint(mesh.point(mesh.from_vertex_handle(heh)));
+}
+
+void mergeCoplanarFaces(PolyMesh& mesh, float angleTolerance, float distanceTolerance) {
+    mesh.update_face_normals();
+    int numFaces = mesh.n_faces();
+    float minDot = std::cos(angleTolerance);
+    float sineTolerance = std::sin(angleTolerance);
+    // Faces get the id of a plane they lie in. The first face in a plane
+    // makes it, later ones are checked against that plane only, so a gently
+    // curved surface can't creep into it face by face. Planes are bucketed
+    // by quantized normal and offset, a face looks in its own bucket and
+    // then in the neighbouring ones. Buckets sharing a hash only cost
+    // extra candidates, every one is checked
+    std::vector<glm::vec4> planes;
+    std::vector<int> planeIds(numFaces, -1);
+    std::unordered_map<uint64_t, std::vector<int>> buckets;
+    auto bucketKey = [&](glm::vec4 plane, int dx, int dy, int dz, int dw) {
+        const float normalStep = std::max(angleTolerance, 1e-6f) * 2.0f;
+        const float offsetStep = std::max(distanceTolerance, 1e-6f) * 2.0f;
+        int64_t cell[] = {
+            (int64_t)std::floor(plane.x / normalStep) + dx,
+            (int64_t)std::floor(plane.y / normalStep) + dy,
+            (int64_t)std::floor(plane.z / normalStep) + dz,
+            (int64_t)std::floor(plane.w / offsetStep) + dw
+        };
+        uint64_t key = 14695981039346656037ull;
+        for(int64_t value : cell)
+            key = (key ^ (uint64_t)value) * 1099511628211ull;
+        return key;
+    };
+    auto isOnPlane = [&](PolyMesh::FaceHandle fh, glm::vec4 plane) {
+        if(glm::dot(vec3FromPoint(mesh.normal(fh)), glm::vec3(plane)) < minDot)
+            return false;
+        for(auto fvh : mesh.fv_range(fh)) {
+            float distance = glm::dot(glm::vec3(plane), vec3FromPoint(mesh.point(fvh))) - plane.w;
+            if(std::abs(distance) > distanceTolerance)
+                return false;
+        }
+        return true;
+    };
+    for(auto fh : mesh.faces()) {
+        glm::vec3 normal = vec3FromPoint(mesh.normal(fh));
+        // Degenerate faces are in no plane
+        if(glm::dot(normal, normal) < 0.5f)
+            continue;
+        glm::vec4 plane(normal, glm::dot(normal, vec3FromPoint(mesh.calc_face_centroid(fh))));
+        int planeId = -1;
+        for(int i = 0; i < 81 && planeId == -1; i++) {
+            // Own bucket first, it is the one that almost always has the plane
+            int offsets[4];
+            for(int axis = 0, rest = (i + 40) % 81; axis < 4; axis++, rest /= 3)
+                offsets[axis] = rest % 3 - 1;
+            auto it = buckets.find(bucketKey(plane, offsets[0], offsets[1], offsets[2], offsets[3]));
+            if(it == buckets.end())
+                continue;
+            for(int candidate : it->second) {
+                if(isOnPlane(fh, planes[candidate])) {
+                    planeId = candidate;
+                    break;
+                }
+            }
+        }
+        if(planeId == -1) {
+            planeId = planes.size();
+            planes.push_back(plane);
+            buckets[bucketKey(plane, 0, 0, 0, 0)].push_back(planeId);
+        }
+        planeIds[fh.idx()] = planeId;
+    }
+    // Neighbours in the same plane are joined as long as the set stays
+    // convex. Editor and FaceTriangulation fan faces into triangles, which
+    // only covers a convex face. Both sets are convex, so they share one
+    // straight run of edges and only the two corners at its ends change
+    FaceSets sets(mesh);
+    bool isAnyMerged = false;
+    // Two halves of a split come back together with both corners straight.
+    // Such joins go first, a join that leaves corners may lock the halves
+    // of another split out. A pair turned down may fit once either side
+    // has grown, so passes repeat while anything is joined. Each is linear
+    int minStraight = 2;
+    while(minStraight >= 0) {
+        bool isMerging = false;
         for(auto eh : mesh.edges()) {
-            if(eh.deleted())
+            PolyMesh::HalfedgeHandle heh = mesh.halfedge_handle(eh, 0);
+            PolyMesh::FaceHandle faceA = mesh.face_handle(heh);
+            PolyMesh::FaceHandle faceB = mesh.opposite_face_handle(heh);
+            if(!faceA.is_valid() || !faceB.is_valid())
                 continue;
-            if(vh.idx() == eh.v0().idx() || vh.idx() == eh.v1().idx())
+            int planeId = planeIds[faceA.idx()];
+            if(planeId == -1 || planeId != planeIds[faceB.idx()])
                 continue;
-            PolyMesh::Point p1 = mesh.point(eh.v0());
-            PolyMesh::Point p2 = mesh.point(eh.v1());
-            PolyMesh::VertexHandle v1 = eh.v0();
-            PolyMesh::VertexHandle v2 = eh.v1();
-            if(isPointLyingOnSegment(point,
-                                     vec3FromPoint(mesh.point(eh.v0())),
-                                     vec3FromPoint(mesh.point(eh.v1()))),
-                                     threshold) {
-                mesh.split_edge(eh, vh);
-                break;
+            int rootA = sets.find(faceA.idx());
+            int rootB = sets.find(faceB.idx());
+            if(rootA == rootB)
+                continue;
+            // Ends of the run along the boundary of a
+            PolyMesh::HalfedgeHandle last = heh;
+            PolyMesh::HalfedgeHandle afterLast = sets.nextOnBoundary(last, rootA);
+            while(sets.across(afterLast) == rootB && afterLast != heh) {
+                last = afterLast;
+                afterLast = sets.nextOnBoundary(last, rootA);
             }
+            PolyMesh::HalfedgeHandle first = heh;
+            PolyMesh::HalfedgeHandle beforeFirst = sets.prevOnBoundary(first, rootA);
+            while(sets.across(beforeFirst) == rootB && beforeFirst != heh) {
+                first = beforeFirst;
+                beforeFirst = sets.prevOnBoundary(first, rootA);
+            }
+            // The run goes all the way around one of them
+            if(afterLast == heh || beforeFirst == heh)
+                continue;
+            glm::vec3 normal = glm::vec3(planes[planeId]);
+            PolyMesh::HalfedgeHandle intoLast =
+                sets.prevOnBoundary(mesh.opposite_halfedge_handle(last), rootB);
+            PolyMesh::HalfedgeHandle outOfFirst =
+                sets.nextOnBoundary(mesh.opposite_halfedge_handle(first), rootB);
+            glm::vec3 corners[2][2] = {
+                { halfedgeVector(mesh, intoLast), halfedgeVector(mesh, afterLast) },
+                { halfedgeVector(mesh, beforeFirst), halfedgeVector(mesh, outOfFirst) }
+            };
+            bool isConvex = true;
+            int numStraight = 0;
+            for(auto& corner : corners) {
+                isConvex = isConvex && isConvexCorner(corner[0], corner[1], normal, sineTolerance);
+                numStraight += isStraightCorner(corner[0], corner[1], sineTolerance) ? 1 : 0;
+            }
+            if(!isConvex || numStraight < minStraight)
+                continue;
+            sets.parents[rootB] = rootA;
+            isAnyMerged = true;
+            isMerging = true;
+        }
+        minStraight = isMerging ? 2 : minStraight - 1;
+    }
+    // The boundary of every set of more than one face is walked once and
+    // becomes its face. Sets are replaced only after all are walked, new
+    // faces are not in the union-find. A set whose face can't be added to
+    // the mesh is put back the way it was
+    std::vector<PolyMesh::VertexHandle> touchedVerts;
+    if(isAnyMerged) {
+        std::vector<int> setSizes(numFaces, 0);
+        for(auto fh : mesh.faces())
+            setSizes[sets.find(fh.idx())]++;
+        std::vector<std::vector<PolyMesh::FaceHandle>> members(numFaces);
+        for(auto fh : mesh.faces()) {
+            int root = sets.find(fh.idx());
+            if(setSizes[root] > 1)
+                members[root].push_back(fh);
+        }
+        std::vector<std::vector<PolyMesh::FaceHandle>> oldFaces;
+        std::vector<std::vector<PolyMesh::VertexHandle>> newFaces;
+        for(int root = 0; root < numFaces; root++) {
+            auto& setFaces = members[root];
+            if(setFaces.empty())
+                continue;
+            PolyMesh::HalfedgeHandle start;
+            int numBoundary = 0;
+            for(auto fh : setFaces) {
+                for(auto fheh : mesh.fh_range(fh)) {
+                    if(sets.across(fheh) == root)
+                        continue;
+                    numBoundary++;
+                    start = fheh;
+                }
+            }
+            std::vector<PolyMesh::VertexHandle> faceVerts;
+            PolyMesh::HalfedgeHandle heh = start;
+            do {
+                faceVerts.push_back(mesh.from_vertex_handle(heh));
+                heh = sets.nextOnBoundary(heh, root);
+            } while(heh != start && faceVerts.size() <= numBoundary);
+            // More than one loop, the set has a hole
+            if(faceVerts.size() != numBoundary)
+                continue;
+            oldFaces.push_back(std::move(setFaces));
+            newFaces.push_back(std::move(faceVerts));
+        }
+        std::vector<std::vector<PolyMesh::VertexHandle>> newFace(1);
+        for(int i = 0; i < oldFaces.size(); i++) {
+            for(auto fh : oldFaces[i]) {
+                for(auto fvh : mesh.fv_range(fh))
+                    touchedVerts.push_back(fvh);
+            }
+            newFace[0].swap(newFaces[i]);
+            replaceFaces(mesh, oldFaces[i], newFace);
         }
     }
-    auto polygons = CSGPolygon::extractFromMesh(mesh);
-    
-    mesh = CSGPolygon::toMesh(polygons);
-//    // Merge vertices that are in the same position
-//    for(auto vh : mesh.vertices()) {
-//        if(/*!isNewProp[vh] ||*/ vh.deleted())
-//            continue;
-//        // TODO: replace nested loop with KD tree traversal
-//        for(auto vh2 : mesh.vertices()) {
-//            if(vh == vh2)
-//                continue;
-//            if((mesh.point(vh) - mesh.point(vh2)).length() > threshold)
-//                continue;
-//            std::list<PolyMesh::FaceHandle> faces;
-//            for(auto fh : vh2.faces_cw())
-//                faces.push_back(fh);
-//            for(auto fh : faces) {
-//                swapFaceVertex(fh, vh2, vh, mesh);
-//            }
-//            faces.clear();
-//            for(auto fh : vh2.faces_cw())
-//                faces.push_back(fh);
-//
-//            mesh.delete_vertex(vh2);
-//        }
-//    }
+    // Vertices inside merged faces are not used by any face now
+    for(auto vh : touchedVerts) {
+        if(!mesh.status(vh).deleted() && mesh.is_isolated(vh))
+            mesh.delete_vertex(vh, false);
+    }
+    // A vertex left in the middle of a straight edge between two faces is
+    // dropped from both, as long as they keep three corners. Dropping a
+    // straight corner keeps a face convex
+    std::vector<int> numCorners(mesh.n_faces(), -1);
+    std::vector<bool> isDissolved(mesh.n_vertices(), false);
+    std::vector<PolyMesh::FaceHandle> dissolvedFaces;
+    for(auto vh : mesh.vertices()) {
+        if(mesh.is_boundary(vh) || mesh.valence(vh) != 2)
+            continue;
+        PolyMesh::HalfedgeHandle toA = mesh.halfedge_handle(vh);
+        PolyMesh::HalfedgeHandle toB = mesh.next_halfedge_handle(mesh.opposite_halfedge_handle(toA));
+        PolyMesh::FaceHandle faceA = mesh.face_handle(toA);
+        PolyMesh::FaceHandle faceB = mesh.face_handle(toB);
+        if(faceA == faceB)
+            continue;
+        glm::vec3 point = vec3FromPoint(mesh.point(vh));
+        glm::vec3 a = vec3FromPoint(mesh.point(mesh.to_vertex_handle(toA))) - point;
+        glm::vec3 b = vec3FromPoint(mesh.point(mesh.to_vertex_handle(toB))) - point;
+        float lengths = glm::length(a) * glm::length(b);
+        if(lengths <= 0.0f || glm::dot(a, b) >= -minDot * lengths)
+            continue;
+        for(auto fh : { faceA, faceB }) {
+            if(numCorners[fh.idx()] == -1) {
+                numCorners[fh.idx()] = mesh.valence(fh);
+                dissolvedFaces.push_back(fh);
+            }
+        }
+        if(numCorners[faceA.idx()] <= 3 || numCorners[faceB.idx()] <= 3)
+            continue;
+        numCorners[faceA.idx()]--;
+        numCorners[faceB.idx()]--;
+        isDissolved[vh.idx()] = true;
+    }
+    std::vector<PolyMesh::FaceHandle> oldFaces;
+    std::vector<std::vector<PolyMesh::VertexHandle>> newFaces;
+    for(auto fh : dissolvedFaces) {
+        if(numCorners[fh.idx()] == mesh.valence(fh))
+            continue;
+        std::vector<PolyMesh::VertexHandle> faceVerts;
+        for(auto fvh : mesh.fv_ccw_range(fh)) {
+            if(!isDissolved[fvh.idx()])
+                faceVerts.push_back(fvh);
+        }
+        oldFaces.push_back(fh);
+        newFaces.push_back(std::move(faceVerts));
+    }
+    if(!oldFaces.empty() && replaceFaces(mesh, oldFaces, newFaces)) {
+        for(auto vh : mesh.vertices()) {
+            if(isDissolved[vh.idx()])
+                mesh.delete_vertex(vh, false);
+        }
+    }
+    mesh.garbage_collection();
+    mesh.update_normals();
+}
+
+void postProcessBooleanMesh(PolyMesh& mesh) {
+    // toMesh only welds around vertices it made. Corners the operands had
+    // at the same place are still apart, and faces meeting there are
+    // not neighbours for mergeCoplanarFaces until they are joined
+    weldVertices(mesh, CSGPlane::Threshold);
+    mesh.garbage_collection();
+    // Normals of small fragments are only as good as their corners,
+    // so the angle is looser than the distance
+    mergeCoplanarFaces(mesh, 0.001f, CSGPlane::Threshold * 10);
 }
@@ -11,8 +11,12 @@
 #include <OpenMesh/Core/Utils/PropertyManager.hh>
 #include <OpenMesh/Tools/Subdivider/Uniform/CatmullClarkT.hh>
 #include <blazevg.hh>
+#include <Arena.h>
+#include <ThreadPool.h>
+#include <TriangleIntersect.h>
 #include <list>
 #include <unordered_map>
+#include <vector>
 
 typedef OpenMesh::PolyMesh_ArrayKernelT<> PolyMesh;
 
@@ -66,11 +70,6 @@ void loopCut(PolyMesh& mesh, bool debug = false);
 void openRegion(PolyMesh& mesh, bool debug = false);
 void bevel(PolyMesh& mesh, int segments = 0, float radius = 30.0f, bool debug = false);
 
-bool rayTriangleIntersect(
-    const glm::vec3 &orig, const glm::vec3 &dir,
-    const glm::vec3 &v0, const glm::vec3 &v1, const glm::vec3 &v2,
-    float &t);
-
 void intersectMeshesOld(PolyMesh& a, PolyMesh& b);
 
 enum class CurrentTransform {
@@ -95,9 +94,45 @@ public:
 
 struct CSGPolygon;
 struct CSGVertex;
+struct CSGPlane;
 struct BSPNode;
 
-static std::map<std::pair<CSGVertex*, CSGVertex*>, CSGVertex*> edgeSplits;
+typedef std::vector<CSGPolygon> CSGPolygonList;
+
+// Vertices made by splitting polygon edges with a plane. Polygons that
+// share an edge and are split by the same plane share the vertex too.
+// Not thread safe, every thread splitting at the same time needs its own.
+// Such a cache can read through to the one it was forked from, so splits
+// made before the fork are still shared. Splits two threads make at the
+// same time are not, toMesh welds those vertices afterwards
+class EdgeSplitCache {
+public:
+    EdgeSplitCache() = default;
+    // parent must not change while this cache is in use
+    explicit EdgeSplitCache(const EdgeSplitCache* parent);
+    
+    // Order of a and b does not matter
+    CSGVertex* find(CSGVertex* a, CSGVertex* b, const CSGPlane* plane) const;
+    void insert(CSGVertex* a, CSGVertex* b, const CSGPlane* plane, CSGVertex* split);
+    // Takes over the entries of other that are missing here
+    void merge(EdgeSplitCache& other);
+    size_t size() const;
+    
+private:
+    struct Key {
+        CSGVertex* a;
+        CSGVertex* b;
+        const CSGPlane* plane;
+        bool operator==(const Key& other) const;
+    };
+    struct KeyHash {
+        size_t operator()(const Key& key) const;
+    };
+    static Key makeKey(CSGVertex* a, CSGVertex* b, const CSGPlane* plane);
+    
+    std::unordered_map<Key, CSGVertex*, KeyHash> splits;
+    const EdgeSplitCache* parent = nullptr;
+};
 
 struct CSGPlane {
     glm::vec3 normal;
@@ -105,14 +140,24 @@ struct CSGPlane {
   
     static constexpr float Threshold = 1e-5;
     
+    // Polygon classification, Spanning is Front | Back
+    static constexpr int Coplanar = 0;
+    static constexpr int Front = 1;
+    static constexpr int Back = 2;
+    static constexpr int Spanning = 3;
+    
     CSGPlane(glm::vec3 normal, float w);
     CSGPlane(glm::vec3 a, glm::vec3 b, glm::vec3 c);
     
-    void splitPolygon(CSGPolygon& polygon,
-                      std::list<CSGPolygon>& coplanarFront,
-                      std::list<CSGPolygon>& coplanarBack,
-                      std::list<CSGPolygon>& front,
-                      std::list<CSGPolygon>& back);
+    int classifyPolygon(const CSGPolygon& polygon) const;
+    
+    void splitPolygon(const CSGPolygon& polygon,
+                      CSGPolygonList& coplanarFront,
+                      CSGPolygonList& coplanarBack,
+                      CSGPolygonList& front,
+                      CSGPolygonList& back,
+                      Arena& arena,
+                      EdgeSplitCache& edgeSplits);
     void flip();
 };
 
@@ -124,50 +169,233 @@ struct CSGVertex {
     glm::vec3 pos, normal;
 //    CSGSharedProps shared;
     
-    struct DeleteInfo {
-        int numUsers = 0;
-    };
-    DeleteInfo deleteInfo;
     PolyMesh::VertexHandle vh = PolyMesh::InvalidVertexHandle;
     bool isNew = false;
     
-    CSGVertex* lerp(CSGVertex& other, float t);
+    CSGVertex* lerp(CSGVertex& other, float t, Arena& arena);
     void flipNormal();
 };
 
+// Vertices of a polygon are a span of the operation's arena, so
+// polygons are small records that are moved around by value.
+// Copies of a polygon share its span
 struct CSGPolygon {
     CSGPlane plane;
-    std::vector<CSGVertex*> verts;
+    CSGVertex** verts;
+    int numVerts;
     
-    CSGPolygon(std::vector<CSGVertex*>& verts);
+    CSGPolygon(CSGVertex** verts, int numVerts);
     void flip();
     
-    static std::list<CSGPolygon> extractFromMesh(PolyMesh& mesh);
-    static PolyMesh toMesh(std::list<CSGPolygon> polygons);
+    static CSGPolygonList extractFromMesh(PolyMesh& mesh, Arena& arena);
+    static PolyMesh toMesh(const CSGPolygonList& polygons);
+};
+
+enum class BSPSplitterMode {
+    // Plane of the first polygon, cheapest to pick
+    First,
+    // Best scoring plane out of several sampled candidates
+    Sampled
+};
+
+struct BSPBuildOptions {
+    BSPSplitterMode splitterMode = BSPSplitterMode::Sampled;
+    int numCandidates = 8;
+    // Number of polygons each candidate is scored against
+    int numScoredPolygons = 64;
+    // Score is splitWeight * splits + balanceWeight * |front - back|,
+    // the lowest score wins
+    float splitWeight = 4.0f;
+    float balanceWeight = 1.0f;
+    // Smaller lists are not worth sampling
+    int minPolygonsToSample = 8;
+};
+
+struct BSPClipOptions {
+    // Subtrees of smaller lists are clipped on the calling thread
+    int minPolygonsToFork = 512;
+    // Bounds the number of forks a single clip can make
+    int maxForkDepth = 8;
+};
+
+struct BSPStats {
+    int numNodes = 0;
+    // Depth of the deepest node, roots are at depth 0
+    int maxDepth = 0;
+};
+
+enum class BooleanStage {
+    Queued,
+    Extract,
+    Cull,
+    Build,
+    Clip,
+    ToMesh,
+    PostProcess,
+    Finished,
+    Cancelled
+};
+
+// Shared between an operation and whoever watches it from another thread
+struct BooleanProgress {
+    std::atomic<BooleanStage> stage { BooleanStage::Queued };
+    std::atomic<bool> isCancelled { false };
+};
+
+// State of one boolean operation. Vertices, planes and nodes
+// are owned by its arena
+struct CSGContext {
+    Arena arena;
+    EdgeSplitCache edgeSplits;
+    BSPBuildOptions buildOptions;
+    BSPClipOptions clipOptions;
+    BSPStats stats;
+    // Clipping runs serially without a pool
+    ThreadPool* pool = nullptr;
+    // Optional, lets another thread follow and cancel the operation
+    BooleanProgress* progress = nullptr;
+    
+    void setStage(BooleanStage stage);
+    // Building and clipping return early once this is set, leaving
+    // trees that are only good for freeing
+    bool isCancelled() const;
 };
 
+// Every traversal runs on an explicit work stack instead of
+// native recursion, so deep trees can't overflow the call stack
 struct BSPNode {
+    CSGContext* context;
     CSGPlane* plane = nullptr;
     BSPNode* front = nullptr;
     BSPNode* back = nullptr;
-    std::list<CSGPolygon> polygons;
+    CSGPolygonList polygons;
+    int depth = 0;
     
-    BSPNode();
-    BSPNode(std::list<CSGPolygon>& polygons);
-    std::list<CSGPolygon> allPolygons();
-    std::list<CSGPolygon> clipPolygons(std::list<CSGPolygon>& polygons);
+    BSPNode(CSGContext& context);
+    BSPNode(CSGPolygonList& polygons, CSGContext& context);
+    CSGPolygonList allPolygons();
+    void collectPolygons(CSGPolygonList& out);
+    // This node and all of its descendants, parents before children
+    void collectNodes(std::vector<BSPNode*>& out);
+    CSGPolygonList clipPolygons(CSGPolygonList& polygons);
+    // Appends the clipped polygons to out, new vertices come from arena
+    // and edgeSplits. Subtrees may be forked onto the context's pool
+    void clipPolygons(const CSGPolygonList& polygons, CSGPolygonList& out,
+                      Arena& arena, EdgeSplitCache& edgeSplits, int forkDepth);
     void clipTo(BSPNode* node);
     void invert();
-    void build(std::list<CSGPolygon>& polygons);
+    void build(CSGPolygonList& polygons);
     
-    static BSPNode* fromMesh(PolyMesh& mesh);
-    static void deepDelete(std::list<BSPNode*> roots);
+    static BSPNode* fromMesh(PolyMesh& mesh, CSGContext& context);
+};
+
+// Polygons of two operands sorted by the overlap of their bounding boxes.
+// Outside that box an operand can't touch the other one, so only the
+// inside lists have to go through the BSP. Polygons crossing the box
+// are split on it, the BSP then sees every face of both operands
+// that lies in the box and nothing else
+struct CSGOverlap {
+    CSGPolygonList insideA, outsideA;
+    CSGPolygonList insideB, outsideB;
+
+    // If the boxes overlap but one operand has no face in the overlap,
+    // the box is entirely inside or outside of it. Nothing is culled
+    // then and everything goes inside
+    static CSGOverlap fromPolygons(const CSGPolygonList& a, const CSGPolygonList& b,
+                                   CSGContext& context);
 };
 
 void unionBSP(BSPNode* a, BSPNode* b);
 void subtractBSP(BSPNode* a, BSPNode* b);
 void intersectBSP(BSPNode* a, BSPNode* b);
 
+enum class BooleanOperation {
+    Union,
+    Subtract,
+    Intersect
+};
+
+// Runs the operation on two polygon lists of the context,
+// only their overlap goes through the BSP
+CSGPolygonList booleanPolygons(const CSGPolygonList& a, const CSGPolygonList& b,
+                               BooleanOperation operation, CSGContext& context);
+// Unions the lists pairwise in a balanced tree. Pairs of one level run
+// in parallel when the context has a pool, the result belongs to context
+CSGPolygonList unionAllPolygons(std::vector<CSGPolygonList> lists, CSGContext& context);
+
+// Mesh kept as a BSP tree in its own local space, for booleans repeated
+// with the same operand. The tree is built once per mesh version and
+// every operation works on a transformed copy of it, so moving the
+// operand costs a copy of the tree instead of a rebuild
+class BooleanOperand {
+public:
+    BooleanOperand() = default;
+    BooleanOperand(const BooleanOperand&) = delete;
+    BooleanOperand& operator=(const BooleanOperand&) = delete;
+    
+    // Rebuilds the tree unless it was already built for this version
+    void setMesh(PolyMesh& mesh, uint64_t version);
+    // Local to world, any affine transform that keeps orientation
+    void setTransform(const glm::mat4& transform);
+    const glm::mat4& getTransform() const;
+    bool isEmpty() const;
+    // Copy of the tree in world space allocated from context
+    BSPNode* instantiate(CSGContext& context) const;
+    
+private:
+    CSGContext local;
+    BSPNode* root = nullptr;
+    uint64_t version = 0;
+    bool hasMesh = false;
+    glm::mat4 transform = glm::mat4(1.0f);
+};
+
+PolyMesh booleanOperands(const BooleanOperand& a, const BooleanOperand& b,
+                         BooleanOperation operation);
+PolyMesh subtractMeshes(const BooleanOperand& a, const BooleanOperand& b);
+
+// Boolean on snapshots of its operands, run on a thread of its own.
+// Dropping the job cancels it and waits for the thread to stop
+class BooleanJob {
+public:
+    BooleanJob(const PolyMesh& a, const PolyMesh& b, BooleanOperation operation);
+    ~BooleanJob();
+    BooleanJob(const BooleanJob&) = delete;
+    BooleanJob& operator=(const BooleanJob&) = delete;
+    
+    BooleanStage getStage() const;
+    bool isFinished() const;
+    // Finished or cancelled, the thread is about to exit
+    bool isDone() const;
+    void cancel();
+    // Result of a finished job, can be taken once
+    PolyMesh takeResult();
+    
+private:
+    PolyMesh a, b;
+    BooleanOperation operation;
+    BooleanProgress progress;
+    PolyMesh result;
+    std::thread thread;
+};
+
+PolyMesh unionMeshes(PolyMesh& a, PolyMesh& b);
 PolyMesh subtractMeshes(PolyMesh& a, PolyMesh& b);
+PolyMesh intersectMeshes(PolyMesh& a, PolyMesh& b);
+// Subtracts all cutters at once. They are unioned first,
+// so a takes a single subtraction however many there are
+PolyMesh subtractMeshes(PolyMesh& a, std::vector<PolyMesh>& cutters);
+
+// Merges vertices closer than threshold into the first of them
+void weldVertices(PolyMesh& mesh, float threshold);
+
+// Merges neighbouring faces that lie in the same plane, so fragments of
+// one original face become fewer, larger faces again, then drops vertices
+// left in the middle of straight edges. Faces are in a plane when their
+// normal is within angleTolerance radians of it and their corners within
+// distanceTolerance. Merged faces are always convex, a non-convex region
+// stays in a few convex pieces. Faces that can't be replaced without
+// making the mesh non-manifold are kept as they are
+void mergeCoplanarFaces(PolyMesh& mesh, float angleTolerance, float distanceTolerance);
 
 void postProcessBooleanMesh(PolyMesh& mesh);
@@ -0,0 +1,122 @@
+//
+//  SpatialHash.cpp
+//  MyProject
+//
+//
+
+#include "SpatialHash.h"
+#include <algorithm>
+#include <cmath>
+
+SpatialHash::SpatialHash(float cellSize):
+    cellSize(cellSize) {}
+
+int SpatialHash::cellCoord(float value) const {
+    return (int)std::floor(value / cellSize);
+}
+
+bool SpatialHash::CellKey::operator==(const CellKey& other) const {
+    return x == other.x && y == other.y && z == other.z;
+}
+
+size_t SpatialHash::CellKeyHash::operator()(const CellKey& key) const {
+    // Large primes, neighbouring cells spread over the buckets
+    return (size_t)((uint64_t)(uint32_t)key.x * 73856093ull ^
+                    (uint64_t)(uint32_t)key.y * 19349663ull ^
+                    (uint64_t)(uint32_t)key.z * 83492791ull);
+}
+
+SpatialHash::CellKey SpatialHash::cellKey(glm::vec3 point) const {
+    return { cellCoord(point.x), cellCoord(point.y), cellCoord(point.z) };
+}
+
+void SpatialHash::build(const std::vector<glm::vec3>& points) {
+    std::vector<std::pair<CellKey, int>> keyed;
+    keyed.reserve(points.size());
+    for(int i = 0; i < points.size(); i++)
+        keyed.push_back({ cellKey(points[i]), i });
+    std::sort(keyed.begin(), keyed.end(), [](const std::pair<CellKey, int>& a,
+                                             const std::pair<CellKey, int>& b) {
+        if(a.first.x != b.first.x)
+            return a.first.x < b.first.x;
+        if(a.first.y != b.first.y)
+            return a.first.y < b.first.y;
+        if(a.first.z != b.first.z)
+            return a.first.z < b.first.z;
+        return a.second < b.second;
+    });
+    indices.resize(keyed.size());
+    cells.clear();
+    cells.reserve(keyed.size());
+    for(int i = 0; i < keyed.size(); i++) {
+        indices[i] = keyed[i].second;
+        if(i == 0 || !(keyed[i].first == keyed[i - 1].first))
+            cells[keyed[i].first] = { i, i };
+        cells[keyed[i].first].end = i + 1;
+    }
+}
+
+void SpatialHash::query(glm::vec3 min, glm::vec3 max, std::vector<int>& out) const {
+    if(cells.empty())
+        return;
+    CellKey first = cellKey(min);
+    CellKey last = cellKey(max);
+    double numBoxCells = (double)(last.x - first.x + 1) * (last.y - first.y + 1) *
+        (last.z - first.z + 1);
+    if(numBoxCells > cells.size()) {
+        // Box is larger than the occupied grid, walk the cells instead
+        for(auto& entry : cells) {
+            const CellKey& key = entry.first;
+            if(key.x < first.x || key.x > last.x || key.y < first.y || key.y > last.y ||
+               key.z < first.z || key.z > last.z)
+                continue;
+            out.insert(out.end(), indices.begin() + entry.second.begin,
+                       indices.begin() + entry.second.end);
+        }
+        return;
+    }
+    for(int x = first.x; x <= last.x; x++) {
+        for(int y = first.y; y <= last.y; y++) {
+            for(int z = first.z; z <= last.z; z++) {
+                auto it = cells.find({ x, y, z });
+                if(it == cells.end())
+                    continue;
+                const Cell& cell = it->second;
+                out.insert(out.end(), indices.begin() + cell.begin, indices.begin() + cell.end);
+            }
+        }
+    }
+}
+
+void SpatialHash::queryRadius(glm::vec3 point, float radius, std::vector<int>& out) const {
+    glm::vec3 extent(radius, radius, radius);
+    query(point - extent, point + extent, out);
+}
+
+float SpatialHash::getCellSize() const {
+    return cellSize;
+}
+
+std::vector<int> weldPoints(const std::vector<glm::vec3>& points,
+                            const std::vector<bool>& isSeed, float threshold) {
+    std::vector<int> weld(points.size(), -1);
+    // Cells twice the threshold keep a lookup within 8 of them
+    SpatialHash hash(threshold * 2);
+    hash.build(points);
+    std::vector<int> candidates;
+    for(int i = 0; i < points.size(); i++) {
+        if(!isSeed[i] || weld[i] != -1)
+            continue;
+        candidates.clear();
+        hash.queryRadius(points[i], threshold, candidates);
+        for(int j : candidates) {
+            if(j == i || weld[j] != -1)
+                continue;
+            if(glm::distance(points[i], points[j]) < threshold) {
+                weld[i] = i;
+                weld[j] = i;
+            }
+        }
+    }
+    return weld;
+}
@@ -0,0 +1,58 @@
+//
+//  SpatialHash.h
+//  MyProject
+//
+//
+
+#pragma once
+
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+// Uniform grid over a fixed set of points. Only occupied cells are
+// stored, point indices of a cell are kept next to each other
+class SpatialHash {
+public:
+    explicit SpatialHash(float cellSize);
+
+    // Replaces the contents, indices returned by queries refer to points
+    void build(const std::vector<glm::vec3>& points);
+    // Appends indices of the points in cells overlapping the box.
+    // Candidates still have to be tested exactly by the caller
+    void query(glm::vec3 min, glm::vec3 max, std::vector<int>& out) const;
+    // Same as query with a box of the given radius around point
+    void queryRadius(glm::vec3 point, float radius, std::vector<int>& out) const;
+
+    float getCellSize() const;
+
+private:
+    // Whole cell coordinates, so far cells never share an entry
+    struct CellKey {
+        int x, y, z;
+
+        bool operator==(const CellKey& other) const;
+    };
+    struct CellKeyHash {
+        size_t operator()(const CellKey& key) const;
+    };
+    struct Cell {
+        int begin;
+        int end;
+    };
+
+    int cellCoord(float value) const;
+    CellKey cellKey(glm::vec3 point) const;
+
+    float cellSize;
+    std::vector<int> indices;
+    std::unordered_map<CellKey, Cell, CellKeyHash> cells;
+};
+
+// Clusters points the way a nested loop over them would: in index order,
+// every seed that is not taken yet takes all free points within threshold.
+// Returns the index of the taking seed for each point, a seed that took
+// anything maps to itself, untouched points map to -1
+std::vector<int> weldPoints(const std::vector<glm::vec3>& points,
+                            const std::vector<bool>& isSeed, float threshold);
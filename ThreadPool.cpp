@@ -0,0 +1,95 @@
+//
+//  ThreadPool.cpp
+//  MyProject
+//
+//
+
+#include "ThreadPool.h"
+
+ThreadPool::ThreadPool(int numThreads) {
+    if(numThreads <= 0)
+        numThreads = (int)std::thread::hardware_concurrency() - 1;
+    if(numThreads < 1)
+        numThreads = 1;
+    workers.reserve(numThreads);
+    for(int i = 0; i < numThreads; i++)
+        workers.emplace_back(&ThreadPool::workerLoop, this);
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    condition.notify_all();
+    for(auto& worker : workers)
+        worker.join();
+}
+
+int ThreadPool::size() const {
+    return workers.size();
+}
+
+void ThreadPool::submit(std::function<void()> task) {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        tasks.push_back(std::move(task));
+    }
+    condition.notify_one();
+}
+
+bool ThreadPool::runPendingTask() {
+    std::function<void()> task;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if(tasks.empty())
+            return false;
+        // Newest first, it is the most likely to touch warm data
+        task = std::move(tasks.back());
+        tasks.pop_back();
+    }
+    task();
+    return true;
+}
+
+ThreadPool& ThreadPool::shared() {
+    static ThreadPool pool;
+    return pool;
+}
+
+void ThreadPool::workerLoop() {
+    while(true) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            condition.wait(lock, [this] { return stopping || !tasks.empty(); });
+            if(tasks.empty())
+                return;
+            task = std::move(tasks.front());
+            tasks.pop_front();
+        }
+        task();
+    }
+}
+
+TaskGroup::TaskGroup(ThreadPool& pool):
+    pool(pool), numPending(0) {}
+
+TaskGroup::~TaskGroup() {
+    wait();
+}
+
+void TaskGroup::run(std::function<void()> task) {
+    numPending++;
+    pool.submit([this, task] {
+        task();
+        numPending--;
+    });
+}
+
+void TaskGroup::wait() {
+    while(numPending.load() > 0) {
+        if(!pool.runPendingTask())
+            std::this_thread::yield();
+    }
+}
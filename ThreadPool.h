@@ -0,0 +1,63 @@
+//
+//  ThreadPool.h
+//  MyProject
+//
+//
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads pulling tasks from one shared queue
+class ThreadPool {
+public:
+    // Zero picks one worker less than the number of hardware threads,
+    // the thread that waits on a TaskGroup does work too
+    explicit ThreadPool(int numThreads = 0);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    int size() const;
+    void submit(std::function<void()> task);
+    // Runs one queued task on the calling thread,
+    // returns false if there was nothing to run
+    bool runPendingTask();
+
+    static ThreadPool& shared();
+
+private:
+    void workerLoop();
+
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> tasks;
+    std::mutex mutex;
+    std::condition_variable condition;
+    bool stopping = false;
+};
+
+// Tasks forked from one place and joined together.
+// Waiting runs queued tasks instead of blocking, so groups
+// can be nested inside tasks without starving the pool
+class TaskGroup {
+public:
+    explicit TaskGroup(ThreadPool& pool);
+    ~TaskGroup();
+
+    TaskGroup(const TaskGroup&) = delete;
+    TaskGroup& operator=(const TaskGroup&) = delete;
+
+    void run(std::function<void()> task);
+    void wait();
+
+private:
+    ThreadPool& pool;
+    std::atomic<int> numPending;
+};
@@ -0,0 +1,444 @@
+//
+//  TriangleIntersect.cpp
+//  MyProject
+//
+//
+
+#include "TriangleIntersect.h"
+#include <algorithm>
+#include <cmath>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#define TRIANGLE_LANES
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define TRIANGLE_LANES
+#endif
+
+static constexpr float TriTriEpsilon = 0.00001f;
+// Smallest determinant of a ray hitting a triangle, below
+// that the ray counts as parallel to it
+static constexpr float RayEpsilon = 0.0001f;
+
+int TriangleBatch::size() const {
+    return coords[0].size();
+}
+
+void TriangleBatch::resize(int size) {
+    for(auto& coord : coords)
+        coord.resize(size);
+}
+
+void TriangleBatch::clear() {
+    for(auto& coord : coords)
+        coord.clear();
+}
+
+void TriangleBatch::set(int index, const TrianglePoints& tri) {
+    const glm::vec3* corners[3] = { &tri.a, &tri.b, &tri.c };
+    for(int corner = 0; corner < 3; corner++) {
+        coords[corner * 3][index] = corners[corner]->x;
+        coords[corner * 3 + 1][index] = corners[corner]->y;
+        coords[corner * 3 + 2][index] = corners[corner]->z;
+    }
+}
+
+void TriangleBatch::push(const TrianglePoints& tri) {
+    resize(size() + 1);
+    set(size() - 1, tri);
+}
+
+TrianglePoints TriangleBatch::get(int index) const {
+    TrianglePoints tri;
+    glm::vec3* corners[3] = { &tri.a, &tri.b, &tri.c };
+    for(int corner = 0; corner < 3; corner++)
+        *corners[corner] = glm::vec3(x(corner)[index], y(corner)[index], z(corner)[index]);
+    return tri;
+}
+
+const float* TriangleBatch::x(int corner) const {
+    return coords[corner * 3].data();
+}
+
+const float* TriangleBatch::y(int corner) const {
+    return coords[corner * 3 + 1].data();
+}
+
+const float* TriangleBatch::z(int corner) const {
+    return coords[corner * 3 + 2].data();
+}
+
+// Signed distances of the corners to the plane, snapped to zero near it.
+// False when all corners are on the same side
+static bool planeDistances(const glm::vec3 points[3], glm::vec3 normal, float offset, float distances[3]) {
+    for(int i = 0; i < 3; i++) {
+        distances[i] = glm::dot(normal, points[i]) + offset;
+        if(fabs(distances[i]) < TriTriEpsilon)
+            distances[i] = 0.0f;
+    }
+    if(distances[0] > 0.0f && distances[1] > 0.0f && distances[2] > 0.0f)
+        return false;
+    if(distances[0] < 0.0f && distances[1] < 0.0f && distances[2] < 0.0f)
+        return false;
+    return true;
+}
+
+// Points where the edges of a triangle crossing the plane meet it. The corner
+// alone on its side is the start of both edges, a corner on the plane gives
+// itself. False when the triangle lies in the plane
+static bool planeCrossing(const glm::vec3 points[3], const float distances[3],
+                          glm::vec3& start, glm::vec3& end) {
+    const float* d = distances;
+    int alone;
+    if(d[0] * d[1] > 0.0f)
+        alone = 2;
+    else if(d[0] * d[2] > 0.0f)
+        alone = 1;
+    else if(d[1] * d[2] > 0.0f || d[0] != 0.0f)
+        alone = 0;
+    else if(d[1] != 0.0f)
+        alone = 1;
+    else if(d[2] != 0.0f)
+        alone = 2;
+    else
+        return false;
+    int next = (alone + 1) % 3;
+    int prev = (alone + 2) % 3;
+    start = points[alone] + (points[next] - points[alone]) * (d[alone] / (d[alone] - d[next]));
+    end = points[alone] + (points[prev] - points[alone]) * (d[alone] / (d[alone] - d[prev]));
+    return true;
+}
+
+static glm::vec2 projectToAxis(glm::vec3 point, int axis) {
+    if(axis == 0)
+        return glm::vec2(point.y, point.z);
+    if(axis == 1)
+        return glm::vec2(point.x, point.z);
+    return glm::vec2(point.x, point.y);
+}
+
+static float orientation(glm::vec2 a, glm::vec2 b, glm::vec2 c) {
+    return (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+}
+
+static bool segmentsIntersect(glm::vec2 a, glm::vec2 b, glm::vec2 c, glm::vec2 d) {
+    if(std::max(a.x, b.x) < std::min(c.x, d.x) || std::max(c.x, d.x) < std::min(a.x, b.x) ||
+       std::max(a.y, b.y) < std::min(c.y, d.y) || std::max(c.y, d.y) < std::min(a.y, b.y))
+        return false;
+    return orientation(a, b, c) * orientation(a, b, d) <= 0.0f &&
+        orientation(c, d, a) * orientation(c, d, b) <= 0.0f;
+}
+
+static bool isPointInTriangle(glm::vec2 point, const glm::vec2 tri[3]) {
+    float o1 = orientation(tri[0], tri[1], point);
+    float o2 = orientation(tri[1], tri[2], point);
+    float o3 = orientation(tri[2], tri[0], point);
+    return (o1 >= 0.0f && o2 >= 0.0f && o3 >= 0.0f) || (o1 <= 0.0f && o2 <= 0.0f && o3 <= 0.0f);
+}
+
+// Overlap of triangles lying in one plane, in the coordinate plane
+// where they have the largest area
+static bool coplanarOverlap(const glm::vec3 pointsA[3], const glm::vec3 pointsB[3], glm::vec3 normal) {
+    glm::vec3 n = glm::abs(normal);
+    int axis = n.x > n.y ? (n.x > n.z ? 0 : 2) : (n.y > n.z ? 1 : 2);
+    glm::vec2 a[3], b[3];
+    for(int i = 0; i < 3; i++) {
+        a[i] = projectToAxis(pointsA[i], axis);
+        b[i] = projectToAxis(pointsB[i], axis);
+    }
+    for(int i = 0; i < 3; i++) {
+        for(int j = 0; j < 3; j++) {
+            if(segmentsIntersect(a[i], a[(i + 1) % 3], b[j], b[(j + 1) % 3]))
+                return true;
+        }
+    }
+    return isPointInTriangle(a[0], b) || isPointInTriangle(b[0], a);
+}
+
+TriTriIntersect triTriIntersect(const TrianglePoints& triA, const TrianglePoints& triB) {
+    TriTriIntersect inter;
+    glm::vec3 pointsA[3] = { triA.a, triA.b, triA.c };
+    glm::vec3 pointsB[3] = { triB.a, triB.b, triB.c };
+    glm::vec3 normalA = glm::cross(triA.b - triA.a, triA.c - triA.a);
+    glm::vec3 normalB = glm::cross(triB.b - triB.a, triB.c - triB.a);
+    float lengthA = glm::length(normalA);
+    float lengthB = glm::length(normalB);
+    // Degenerate triangles
+    if(lengthA == 0.0f || lengthB == 0.0f)
+        return inter;
+    normalA /= lengthA;
+    normalB /= lengthB;
+    float distancesB[3];
+    if(!planeDistances(pointsB, normalA, -glm::dot(normalA, triA.a), distancesB))
+        return inter;
+    float distancesA[3];
+    if(!planeDistances(pointsA, normalB, -glm::dot(normalB, triB.a), distancesA))
+        return inter;
+    glm::vec3 startA, endA, startB, endB;
+    if(!planeCrossing(pointsA, distancesA, startA, endA) ||
+       !planeCrossing(pointsB, distancesB, startB, endB)) {
+        if(coplanarOverlap(pointsA, pointsB, normalA)) {
+            inter.intersects = true;
+            inter.isCoplanar = true;
+        }
+        return inter;
+    }
+    // Both intervals lie on the line where the planes meet,
+    // the intersection is where they overlap
+    glm::vec3 direction = glm::cross(normalA, normalB);
+    float directionLength = glm::length(direction);
+    if(directionLength < TriTriEpsilon)
+        return inter;
+    direction /= directionLength;
+    float tStartA = glm::dot(direction, startA);
+    float tEndA = glm::dot(direction, endA);
+    float tStartB = glm::dot(direction, startB);
+    float tEndB = glm::dot(direction, endB);
+    if(tStartA > tEndA) {
+        std::swap(tStartA, tEndA);
+        std::swap(startA, endA);
+    }
+    if(tStartB > tEndB) {
+        std::swap(tStartB, tEndB);
+        std::swap(startB, endB);
+    }
+    float tStart = std::max(tStartA, tStartB);
+    float tEnd = std::min(tEndA, tEndB);
+    if(tStart > tEnd + TriTriEpsilon)
+        return inter;
+    inter.intersects = true;
+    inter.a = tStartA > tStartB ? startA : startB;
+    inter.b = tStart > tEnd ? inter.a : (tEndA < tEndB ? endA : endB);
+    return inter;
+}
+
+static void testTriangle(const TrianglePoints& tri, const TriangleBatch& batch, int index,
+                         std::vector<TriTriHit>& out) {
+    TriTriIntersect inter = triTriIntersect(tri, batch.get(index));
+    if(inter.intersects)
+        out.push_back({ index, inter });
+}
+
+#ifdef TRIANGLE_LANES
+
+#if defined(__AVX__)
+struct Lanes {
+    typedef __m256 F;
+    static constexpr int Width = 8;
+    static F load(const float* p) { return _mm256_loadu_ps(p); }
+    static F set(float value) { return _mm256_set1_ps(value); }
+    static F add(F a, F b) { return _mm256_add_ps(a, b); }
+    static F sub(F a, F b) { return _mm256_sub_ps(a, b); }
+    static F mul(F a, F b) { return _mm256_mul_ps(a, b); }
+    static F sqrt(F a) { return _mm256_sqrt_ps(a); }
+    static F greater(F a, F b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+    static F both(F a, F b) { return _mm256_and_ps(a, b); }
+    static F div(F a, F b) { return _mm256_div_ps(a, b); }
+    static F either(F a, F b) { return _mm256_or_ps(a, b); }
+    static F without(F a, F b) { return _mm256_andnot_ps(b, a); }
+    static void store(float* p, F a) { _mm256_storeu_ps(p, a); }
+    static int mask(F a) { return _mm256_movemask_ps(a); }
+};
+#else
+struct Lanes {
+    typedef __m128 F;
+    static constexpr int Width = 4;
+    static F load(const float* p) { return _mm_loadu_ps(p); }
+    static F set(float value) { return _mm_set1_ps(value); }
+    static F add(F a, F b) { return _mm_add_ps(a, b); }
+    static F sub(F a, F b) { return _mm_sub_ps(a, b); }
+    static F mul(F a, F b) { return _mm_mul_ps(a, b); }
+    static F sqrt(F a) { return _mm_sqrt_ps(a); }
+    static F greater(F a, F b) { return _mm_cmpgt_ps(a, b); }
+    static F both(F a, F b) { return _mm_and_ps(a, b); }
+    static F div(F a, F b) { return _mm_div_ps(a, b); }
+    static F either(F a, F b) { return _mm_or_ps(a, b); }
+    static F without(F a, F b) { return _mm_andnot_ps(b, a); }
+    static void store(float* p, F a) { _mm_storeu_ps(p, a); }
+    static int mask(F a) { return _mm_movemask_ps(a); }
+};
+#endif
+
+// Bit mask of the triangles starting at first that lie entirely on one
+// side of the plane of tri, or have tri entirely on one side of theirs
+static int rejectLanes(const glm::vec3 points[3], glm::vec3 normal, float offset,
+                       const TriangleBatch& batch, int first) {
+    typedef Lanes L;
+    L::F x[3], y[3], z[3];
+    for(int i = 0; i < 3; i++) {
+        x[i] = L::load(batch.x(i) + first);
+        y[i] = L::load(batch.y(i) + first);
+        z[i] = L::load(batch.z(i) + first);
+    }
+    L::F zero = L::set(0.0f);
+    L::F epsilon = L::set(TriTriEpsilon);
+    L::F negEpsilon = L::set(-TriTriEpsilon);
+    // Batch triangles against the plane of tri
+    L::F above, below;
+    for(int i = 0; i < 3; i++) {
+        L::F distance = L::add(L::add(L::mul(L::set(normal.x), x[i]), L::mul(L::set(normal.y), y[i])),
+                               L::add(L::mul(L::set(normal.z), z[i]), L::set(offset)));
+        L::F isAbove = L::greater(distance, epsilon);
+        L::F isBelow = L::greater(negEpsilon, distance);
+        above = i == 0 ? isAbove : L::both(above, isAbove);
+        below = i == 0 ? isBelow : L::both(below, isBelow);
+    }
+    // tri against the planes of the batch triangles. Their normals
+    // are not normalized, so the epsilon is scaled instead
+    L::F e1x = L::sub(x[1], x[0]), e1y = L::sub(y[1], y[0]), e1z = L::sub(z[1], z[0]);
+    L::F e2x = L::sub(x[2], x[0]), e2y = L::sub(y[2], y[0]), e2z = L::sub(z[2], z[0]);
+    L::F nx = L::sub(L::mul(e1y, e2z), L::mul(e1z, e2y));
+    L::F ny = L::sub(L::mul(e1z, e2x), L::mul(e1x, e2z));
+    L::F nz = L::sub(L::mul(e1x, e2y), L::mul(e1y, e2x));
+    L::F scaledEpsilon = L::mul(epsilon, L::sqrt(L::add(L::add(L::mul(nx, nx), L::mul(ny, ny)),
+                                                          L::mul(nz, nz))));
+    L::F negScaledEpsilon = L::sub(zero, scaledEpsilon);
+    L::F aboveOther, belowOther;
+    for(int i = 0; i < 3; i++) {
+        L::F dx = L::sub(L::set(points[i].x), x[0]);
+        L::F dy = L::sub(L::set(points[i].y), y[0]);
+        L::F dz = L::sub(L::set(points[i].z), z[0]);
+        L::F distance = L::add(L::add(L::mul(nx, dx), L::mul(ny, dy)), L::mul(nz, dz));
+        L::F isAbove = L::greater(distance, scaledEpsilon);
+        L::F isBelow = L::greater(negScaledEpsilon, distance);
+        aboveOther = i == 0 ? isAbove : L::both(aboveOther, isAbove);
+        belowOther = i == 0 ? isBelow : L::both(belowOther, isBelow);
+    }
+    return L::mask(L::either(L::either(above, below), L::either(aboveOther, belowOther)));
+}
+
+// Loads count coordinates, padding with zeros up to the full width.
+// Zero triangles are degenerate and never hit
+static Lanes::F loadLanes(const float* p, int count) {
+    if(count >= Lanes::Width)
+        return Lanes::load(p);
+    float padded[Lanes::Width] = {};
+    for(int i = 0; i < count; i++)
+        padded[i] = p[i];
+    return Lanes::load(padded);
+}
+
+// Möller–Trumbore for the triangles starting at first. Returns the bit mask of
+// the hit ones, distances to them go to distances
+static int rayLanes(glm::vec3 origin, glm::vec3 direction, const TriangleBatch& batch, int first,
+                    int count, float distances[Lanes::Width]) {
+    typedef Lanes L;
+    L::F x[3], y[3], z[3];
+    for(int i = 0; i < 3; i++) {
+        x[i] = loadLanes(batch.x(i) + first, count);
+        y[i] = loadLanes(batch.y(i) + first, count);
+        z[i] = loadLanes(batch.z(i) + first, count);
+    }
+    L::F zero = L::set(0.0f);
+    L::F one = L::set(1.0f);
+    L::F dx = L::set(direction.x), dy = L::set(direction.y), dz = L::set(direction.z);
+    L::F e1x = L::sub(x[1], x[0]), e1y = L::sub(y[1], y[0]), e1z = L::sub(z[1], z[0]);
+    L::F e2x = L::sub(x[2], x[0]), e2y = L::sub(y[2], y[0]), e2z = L::sub(z[2], z[0]);
+    L::F px = L::sub(L::mul(dy, e2z), L::mul(dz, e2y));
+    L::F py = L::sub(L::mul(dz, e2x), L::mul(dx, e2z));
+    L::F pz = L::sub(L::mul(dx, e2y), L::mul(dy, e2x));
+    L::F det = L::add(L::add(L::mul(e1x, px), L::mul(e1y, py)), L::mul(e1z, pz));
+    L::F isHit = L::either(L::greater(det, L::set(RayEpsilon)), L::greater(L::set(-RayEpsilon), det));
+    L::F invDet = L::div(one, det);
+    L::F sx = L::sub(L::set(origin.x), x[0]);
+    L::F sy = L::sub(L::set(origin.y), y[0]);
+    L::F sz = L::sub(L::set(origin.z), z[0]);
+    L::F u = L::mul(L::add(L::add(L::mul(sx, px), L::mul(sy, py)), L::mul(sz, pz)), invDet);
+    isHit = L::without(isHit, L::either(L::greater(zero, u), L::greater(u, one)));
+    L::F qx = L::sub(L::mul(sy, e1z), L::mul(sz, e1y));
+    L::F qy = L::sub(L::mul(sz, e1x), L::mul(sx, e1z));
+    L::F qz = L::sub(L::mul(sx, e1y), L::mul(sy, e1x));
+    L::F v = L::mul(L::add(L::add(L::mul(dx, qx), L::mul(dy, qy)), L::mul(dz, qz)), invDet);
+    isHit = L::without(isHit, L::either(L::greater(zero, v), L::greater(L::add(u, v), one)));
+    L::F distance = L::mul(L::add(L::add(L::mul(e2x, qx), L::mul(e2y, qy)), L::mul(e2z, qz)), invDet);
+    isHit = L::without(isHit, L::greater(zero, distance));
+    L::store(distances, distance);
+    return L::mask(isHit);
+}
+
+#endif
+
+bool rayTriangleIntersect(
+    const glm::vec3 &orig, const glm::vec3 &dir,
+    const glm::vec3 &v0, const glm::vec3 &v1, const glm::vec3 &v2,
+    float &t)
+{
+    glm::vec3 edge1 = v1 - v0;
+    glm::vec3 edge2 = v2 - v0;
+    glm::vec3 p = glm::cross(dir, edge2);
+    float det = glm::dot(edge1, p);
+    // Parallel to the triangle
+    if(fabs(det) < RayEpsilon)
+        return false;
+    float invDet = 1.0f / det;
+    glm::vec3 s = orig - v0;
+    float u = glm::dot(s, p) * invDet;
+    if(u < 0.0f || u > 1.0f)
+        return false;
+    glm::vec3 q = glm::cross(s, edge1);
+    float v = glm::dot(dir, q) * invDet;
+    if(v < 0.0f || u + v > 1.0f)
+        return false;
+    float distance = glm::dot(edge2, q) * invDet;
+    // Behind the ray
+    if(distance < 0.0f)
+        return false;
+    t = distance;
+    return true;
+}
+
+int rayTriangleIntersect(glm::vec3 origin, glm::vec3 direction, const TriangleBatch& batch,
+                         int first, int count, float& t) {
+    int nearest = -1;
+    int end = first + count;
+#ifdef TRIANGLE_LANES
+    for(int index = first; index < end; index += Lanes::Width) {
+        float distances[Lanes::Width];
+        int hits = rayLanes(origin, direction, batch, index, end - index, distances);
+        for(int lane = 0; hits != 0; lane++, hits >>= 1) {
+            if((hits & 1) && distances[lane] < t) {
+                t = distances[lane];
+                nearest = index + lane;
+            }
+        }
+    }
+#else
+    for(int index = first; index < end; index++) {
+        TrianglePoints tri = batch.get(index);
+        float distance = 0.0f;
+        if(rayTriangleIntersect(origin, direction, tri.a, tri.b, tri.c, distance) && distance < t) {
+            t = distance;
+            nearest = index;
+        }
+    }
+#endif
+    return nearest;
+}
+
+void triTriIntersect(const TrianglePoints& tri, const TriangleBatch& batch, int first, int count,
+                     std::vector<TriTriHit>& out) {
+    int end = first + count;
+    int index = first;
+#ifdef TRIANGLE_LANES
+    glm::vec3 normal = glm::cross(tri.b - tri.a, tri.c - tri.a);
+    float length = glm::length(normal);
+    if(length == 0.0f)
+        return;
+    normal /= length;
+    float offset = -glm::dot(normal, tri.a);
+    glm::vec3 points[3] = { tri.a, tri.b, tri.c };
+    constexpr int allRejected = (1 << Lanes::Width) - 1;
+    for(; index + Lanes::Width <= end; index += Lanes::Width) {
+        int rejected = rejectLanes(points, normal, offset, batch, index);
+        if(rejected == allRejected)
+            continue;
+        for(int lane = 0; lane < Lanes::Width; lane++) {
+            if(!(rejected & (1 << lane)))
+                testTriangle(tri, batch, index + lane, out);
+        }
+    }
+#endif
+    for(; index < end; index++)
+        testTriangle(tri, batch, index, out);
+}
@@ -0,0 +1,71 @@
+//
+//  TriangleIntersect.h
+//  MyProject
+//
+//
+
+#pragma once
+
+#include <glm/glm.hpp>
+#include <vector>
+
+struct TrianglePoints {
+    glm::vec3 a, b, c;
+};
+
+struct TriTriIntersect {
+    glm::vec3 a, b;
+    bool intersects = false;
+    // Both triangles lie in one plane and overlap, a and b are not set then
+    bool isCoplanar = false;
+};
+
+struct TriTriHit {
+    int index;
+    TriTriIntersect intersect;
+};
+
+// Triangles in structure of arrays layout, so that one triangle
+// can be tested against several of them at once
+class TriangleBatch {
+public:
+    int size() const;
+    void resize(int size);
+    void clear();
+    void set(int index, const TrianglePoints& tri);
+    void push(const TrianglePoints& tri);
+    TrianglePoints get(int index) const;
+
+    // Coordinates of one corner (0 is a, 1 is b, 2 is c) of every triangle
+    const float* x(int corner) const;
+    const float* y(int corner) const;
+    const float* z(int corner) const;
+
+private:
+    // x, y and z of corner a, then of b, then of c
+    std::vector<float> coords[9];
+};
+
+// Interval overlap test of Möller. Points closer to the plane of the other
+// triangle than TriTriEpsilon lie on it, so touching triangles intersect
+// along the touching edge or at the touching point
+TriTriIntersect triTriIntersect(const TrianglePoints& triA, const TrianglePoints& triB);
+
+// Tests tri against count triangles of batch starting at first and appends
+// the intersecting ones. Triangles lying entirely on one side of the other's
+// plane are rejected several at a time with AVX or SSE when the build
+// enables them, the rest go through the test above
+void triTriIntersect(const TrianglePoints& tri, const TriangleBatch& batch, int first, int count,
+                     std::vector<TriTriHit>& out);
+
+// Möller–Trumbore, hits from both sides. t is the distance along dir
+bool rayTriangleIntersect(
+    const glm::vec3 &orig, const glm::vec3 &dir,
+    const glm::vec3 &v0, const glm::vec3 &v1, const glm::vec3 &v2,
+    float &t);
+
+// Same against count triangles of batch starting at first, several at a time
+// with AVX or SSE when the build enables them. Returns the nearest triangle hit
+// closer than t and sets t to the distance to it, or returns -1
+int rayTriangleIntersect(glm::vec3 origin, glm::vec3 direction, const TriangleBatch& batch,
+                         int first, int count, float& t);